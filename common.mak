@@ -38,7 +38,15 @@ nlplatform_sources = \
     nltime.c \
 
 ifneq ($(BUILD_FEATURE_NO_SPI_FLASH),1)
-nlplatform_sources += nlflash_spi.c nlfs.c
+nlplatform_sources += nlflash_spi.c nlfs.c nlspi_lines.c
+endif
+
+ifeq ($(BUILD_FEATURE_FLASH_STRIPE),1)
+nlplatform_sources += nlflash_stripe.c
+endif
+
+ifeq ($(BUILD_FEATURE_FLASH_SCHED),1)
+nlplatform_sources += nlflash_sched.c
 endif
 
 ifeq ($(BUILD_FEATURE_NL_PROFILE),1)
@@ -57,12 +57,179 @@ extern "C" {
 void nlflash_init(void);
 int nlflash_request(nlflash_id_t flash_id);
 int nlflash_release(nlflash_id_t flash_id);
+/* Batch several operations under one lock and one request, so a run of
+ * small operations doesn't power the flash up and down for each.  Unlike
+ * nlflash_request(), nlflash_begin() holds nothing when it fails, whether
+ * the lock or the request failed.  Between nlflash_begin() and
+ * nlflash_end() the nlflash calls for the flash can be made as usual.
+ */
+int nlflash_begin(nlflash_id_t flash_id);
+int nlflash_end(nlflash_id_t flash_id);
+
+/* Do ops in order inside nlflash_begin()/nlflash_end(), stopping at the
+ * first that fails and returning its error.  Each op's retlen is set to
+ * the bytes it read, wrote or erased; ops that weren't done get 0.
+ */
+typedef enum {
+    NLFLASH_OP_READ,
+    NLFLASH_OP_WRITE,
+    NLFLASH_OP_ERASE
+} nlflash_op_type_t;
+
+typedef struct {
+    nlflash_op_type_t type;
+    uint32_t addr;
+    size_t len;
+    void *buf;                  // read into or written from; unused by erases
+    size_t retlen;
+} nlflash_op_t;
+int nlflash_transact(nlflash_id_t flash_id, nlflash_op_t *ops, unsigned num_ops);
 int nlflash_flush(nlflash_id_t flash_id);
+/* Like nlflash_flush(), but only writes out data cached for [addr, addr + len),
+ * so one writer can commit its data without flushing other writers' pages.
+ */
+int nlflash_flush_range(nlflash_id_t flash_id, uint32_t addr, size_t len);
 int nlflash_read_id(nlflash_id_t flash_id, uint8_t *id_buf, size_t id_buf_size);
 const nlflash_info_t *nlflash_get_info(nlflash_id_t flash_id);
 int nlflash_erase(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen, nlloop_callback_fp callback);
 int nlflash_read(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback);
 int nlflash_write(nlflash_id_t flash_id, uint32_t to, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback);
+
+/* Asynchronous read.  nlflash_read_async() starts the read and returns;
+ * callback is invoked, possibly from interrupt context, once the data
+ * is in buf.  The flash stays locked and powered until the caller invokes
+ * nlflash_read_async_finish() from task context, which returns the result
+ * of the read.  If nlflash_read_async() fails, callback is not invoked
+ * and nlflash_read_async_finish() must not be called.
+ */
+typedef void (*nlflash_async_handler_t)(int result, void *context);
+int nlflash_read_async(nlflash_id_t flash_id, uint32_t from, size_t len, uint8_t *buf,
+                       nlflash_async_handler_t callback, void *context);
+int nlflash_read_async_finish(nlflash_id_t flash_id);
+
+/* Streaming write.  producer is called to fill buf with up to len bytes of
+ * the data to write next and returns the number of bytes it filled, 0 at
+ * the end of the data or a negative error, which is returned.  The flash
+ * may call producer for the next page while the previous one programs, so
+ * the time spent producing data (decompressing, decrypting, receiving)
+ * overlaps the program time, and producer must not access the same flash.
+ * At most len bytes are written starting at to, and *retlen is set to the
+ * number written.
+ */
+typedef int (*nlflash_write_producer_t)(uint8_t *buf, size_t len, void *context);
+int nlflash_write_stream(nlflash_id_t flash_id, uint32_t to, size_t len, size_t *retlen,
+                         nlflash_write_producer_t producer, void *context);
+
+/* Read session, for many small sequential reads.  nlflash_read_session_begin()
+ * locks the flash and starts a read at from, each nlflash_read_session_read()
+ * returns the next len bytes, and nlflash_read_session_end() ends the read and
+ * unlocks the flash.  Flash that supports sessions keeps one read command
+ * going for the whole session, so each read only transfers data; other
+ * flash reads each piece normally.  Don't do other operations on the flash
+ * during a session; on flash that keeps the read going they fail with -EBUSY.
+ */
+int nlflash_read_session_begin(nlflash_id_t flash_id, uint32_t from);
+int nlflash_read_session_read(nlflash_id_t flash_id, size_t len, size_t *retlen, uint8_t *buf);
+int nlflash_read_session_end(nlflash_id_t flash_id);
+
+/* Vectored read and write.  iov[0..iovcnt) are read from or written to
+ * consecutive flash addresses starting at from/to, e.g. a record header and
+ * its payload, without a bounce buffer or a call per piece.  *retlen is set
+ * to the number of bytes transferred.  Flash that can't transfer several
+ * buffers in one command does them one at a time, under one lock.
+ */
+typedef struct {
+    void *base;
+    size_t len;
+} nlflash_iovec_t;
+int nlflash_readv(nlflash_id_t flash_id, uint32_t from, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen);
+int nlflash_writev(nlflash_id_t flash_id, uint32_t to, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen);
+
+/* Copy len bytes at src on src_id to dst on dst_id, e.g. to install an image.
+ * Both flash are locked and kept powered for the whole copy, and when dst_id
+ * streams writes the reads from src_id overlap its programs.  dst must be
+ * erased and meet dst_id's write alignment.  With skip_matching, destination
+ * pages that already hold the source data aren't programmed again.  *retlen
+ * is set to the number of bytes copied, counting skipped ones.  The ranges
+ * can't overlap when src_id and dst_id are the same.
+ */
+int nlflash_copy(nlflash_id_t src_id, uint32_t src, nlflash_id_t dst_id, uint32_t dst, size_t len,
+                 size_t *retlen, bool skip_matching);
+
+/* Like nlflash_erase(), but reads the range first and only erases the
+ * erase_size sectors that aren't already blank (all 0xFF).  *skipped is
+ * set to the number of sectors that didn't need erasing, and *retlen
+ * counts them as erased.
+ */
+int nlflash_erase_blank_check(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen,
+                              size_t *skipped, nlloop_callback_fp callback);
+
+/* Returns true if all len bytes of buf are 0xFF.  buf must be 4 byte aligned. */
+bool nlflash_buf_is_blank(const void *buf, size_t len);
+
+/* Expected time in microseconds that nlflash_erase() would take to erase
+ * the given range, for progress reporting.  Returns -ENOTSUP if the flash
+ * can't predict erase times.
+ */
+int nlflash_get_erase_time(nlflash_id_t flash_id, uint32_t from, size_t len, uint32_t *usec);
+/* Read cache.  With NLFLASH_CACHE_NUM_BLOCKS > 0, reads of up to
+ * NLFLASH_CACHE_MAX_READ_SIZE bytes from flash with the cache enabled go
+ * through a pool of NLFLASH_CACHE_BLOCK_SIZE byte blocks shared by all such
+ * flash, replacing the least recently used block on a miss.  Writes,
+ * erases and flushes through nlflash drop the blocks they touch; code that
+ * changes a flash without going through nlflash must call
+ * nlflash_cache_invalidate().  Without blocks, enabling returns -ENOTSUP.
+ * The counters, across all flash, help size the cache.
+ */
+typedef struct {
+    uint32_t hits;
+    uint32_t misses;
+} nlflash_cache_stats_t;
+int nlflash_cache_enable(nlflash_id_t flash_id, bool enable);
+void nlflash_cache_invalidate(nlflash_id_t flash_id, uint32_t addr, size_t len);
+void nlflash_cache_get_stats(nlflash_cache_stats_t *stats);
+void nlflash_cache_reset_stats(void);
+
+/* Operation statistics.  With NLFLASH_USE_STATS, nlflash counts the reads,
+ * writes and erases done through nlflash_read()/_readv(), nlflash_write()/
+ * _writev()/_write_stream() and nlflash_erase()/_erase_blank_check() on
+ * each flash, with the bytes they transferred and how many failed.  It also
+ * keeps histograms of the time spent waiting for the flash lock, powering
+ * up the flash (its request) and doing the operation.  The times come from
+ * the ms system clock: bucket 0 counts times under 1 ms and bucket i times
+ * in [2^(i-1), 2^i) ms, except the last, which counts everything longer.
+ * A lock wait is only counted for the outermost lock, once, by the first
+ * operation under it.  Reads served by preempting another task's program
+ * or erase aren't counted.  Without NLFLASH_USE_STATS,
+ * nlflash_get_stats() returns -ENOTSUP.
+ */
+#ifndef NLFLASH_STATS_NUM_BUCKETS
+#define NLFLASH_STATS_NUM_BUCKETS 16
+#endif
+
+typedef enum {
+    NLFLASH_STATS_READ,
+    NLFLASH_STATS_WRITE,
+    NLFLASH_STATS_ERASE,
+    NLFLASH_STATS_NUM_OPS
+} nlflash_stats_op_t;
+
+typedef enum {
+    NLFLASH_STATS_LOCK_WAIT,
+    NLFLASH_STATS_REQUEST,
+    NLFLASH_STATS_OP_TIME,
+    NLFLASH_STATS_NUM_LATENCIES
+} nlflash_stats_latency_t;
+
+typedef struct {
+    uint32_t ops[NLFLASH_STATS_NUM_OPS];
+    uint32_t errors[NLFLASH_STATS_NUM_OPS];
+    uint64_t bytes[NLFLASH_STATS_NUM_OPS];
+    uint32_t latency[NLFLASH_STATS_NUM_LATENCIES][NLFLASH_STATS_NUM_BUCKETS];
+} nlflash_stats_t;
+int nlflash_get_stats(nlflash_id_t flash_id, nlflash_stats_t *stats);
+void nlflash_reset_stats(nlflash_id_t flash_id);
+
 void nlflash_set_lock(nlflash_id_t flash_id, int ( *lock)(void *), int (* unlock)(void *), void *lock_ctx);
 int nlflash_lock(nlflash_id_t flash_id);
 int nlflash_unlock(nlflash_id_t flash_id);
@@ -78,6 +245,37 @@ typedef struct nlflash_func_table_s
     int (*erase)(uint32_t from, size_t len, size_t *retlen, nlloop_callback_fp inLoopCallback);
     int (*read)(uint32_t from, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp inLoopCallback);
     int (*write)(uint32_t to, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp inLoopCallback);
+    int (*read_async)(uint32_t from, size_t len, uint8_t *buf, nlflash_async_handler_t callback, void *context);
+    int (*read_async_finish)(void);
+    int (*get_erase_time)(uint32_t from, size_t len, uint32_t *usec);
+    int (*erase_blank_check)(uint32_t from, size_t len, size_t *retlen, size_t *skipped, nlloop_callback_fp inLoopCallback);
+    /* Called by nlflash_read() without the lock held, to serve a read while
+     * another task's program or erase is suspended.  Returns -EAGAIN when
+     * the read must go through the locked read instead.
+     */
+    int (*read_preempt)(uint32_t from, size_t len, size_t *retlen, uint8_t *buf);
+    int (*flush_range)(uint32_t addr, size_t len);
+    int (*write_stream)(uint32_t to, size_t len, size_t *retlen, nlflash_write_producer_t producer, void *context);
+    int (*read_session_begin)(uint32_t from);
+    int (*read_session_read)(size_t len, size_t *retlen, uint8_t *buf);
+    int (*read_session_end)(void);
+    /* Start programming [to, to + len), within one write_size page, and
+     * return without waiting for it, so programs on several flash can run
+     * at once.  buf must stay valid until write_finish(), which waits for
+     * the program and returns its result.
+     */
+    int (*write_start)(uint32_t to, size_t len, const uint8_t *buf);
+    int (*write_finish)(void);
+    /* Start erasing [from, from + len), one erase_size or fast_erase_size
+     * block aligned to its size, and return without waiting for it, so
+     * erases on several flash can run at once.  erase_finish() waits for
+     * the erase and returns its result.
+     */
+    int (*erase_start)(uint32_t from, size_t len);
+    int (*erase_finish)(void);
+    /* Return -ENOTSUP to have nlflash.c do the buffers one at a time. */
+    int (*readv)(uint32_t from, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen);
+    int (*writev)(uint32_t to, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen);
 } nlflash_func_table_t;
 
 extern const nlflash_func_table_t g_flash_device_table[NL_NUM_FLASH_IDS];
@@ -0,0 +1,110 @@
+/*
+ *
+ *    Copyright (c) 2018 Nest Labs, Inc.
+ *    All rights reserved.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ *    Description:
+ *      This file defines an API for queueing flash reads, writes
+ *      and erases to a flash service task, which does them in
+ *      priority order.
+ *
+ */
+
+#ifndef __NLFLASH_SCHED_H_INCLUDED__
+#define __NLFLASH_SCHED_H_INCLUDED__
+
+#include <nlplatform/nlflash.h>
+
+// the scheduler needs its task
+#ifndef NL_NO_RTOS
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    NLFLASH_SCHED_READ,
+    NLFLASH_SCHED_WRITE,
+    NLFLASH_SCHED_ERASE
+} nlflash_sched_op_t;
+
+typedef struct nlflash_sched_request_s nlflash_sched_request_t;
+
+typedef void (*nlflash_sched_handler_t)(nlflash_sched_request_t *request);
+
+/* The service task splits writes and erases (and long reads) into slices
+ * and picks the next slice from the queued request with the highest
+ * priority, then the earliest deadline, then reads before writes and
+ * erases, then the oldest.  So a read queued behind a long erase waits
+ * for at most one slice of it.
+ *
+ * The caller owns the request, which must be zeroed before its first use
+ * and stay valid until it completes.  On completion the service task sets
+ * result and done, then calls callback if set and notifies task if set
+ * (see nlflash_sched_wait()).  Erases must be aligned to the flash's
+ * erase_size.
+ */
+struct nlflash_sched_request_s {
+    // set by the caller
+    nlflash_sched_op_t op;
+    nlflash_id_t flash_id;
+    uint32_t addr;
+    size_t len;
+    void *buf;                          // read into, or written from
+    uint8_t priority;                   // higher goes first
+    TickType_t deadline;                // tick count, or 0 for none
+    nlflash_sched_handler_t callback;   // called from the service task, may be NULL
+    TaskHandle_t task;                  // notified on completion, may be NULL
+
+    // set by the scheduler
+    size_t done;                        // bytes read, written or erased
+    int result;
+    volatile bool busy;                 // queued or in progress
+    uint32_t seq;
+    nlflash_sched_request_t *next;
+};
+
+/* Start the service task. */
+void nlflash_sched_init(void);
+
+/* Queue request.  Returns -EINVAL for a bad request and -EBUSY if it's
+ * already queued.
+ */
+int nlflash_sched_submit(nlflash_sched_request_t *request);
+
+/* Take request off the queue before it's started.  Returns -EBUSY if the
+ * service task has started it, even if it's queued between slices, and
+ * -ENOENT if it isn't queued.  Neither callback nor task is signalled for
+ * a cancelled request.
+ */
+int nlflash_sched_cancel(nlflash_sched_request_t *request);
+
+/* Called by request->task to wait for request to complete.  Returns
+ * request->result.
+ */
+int nlflash_sched_wait(nlflash_sched_request_t *request);
+
+#endif /* !defined(NL_NO_RTOS) */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NLFLASH_SCHED_H_INCLUDED__ */
@@ -33,18 +33,188 @@
 extern "C" {
 #endif
 
+/* How a command is framed on the bus: the cmd byte always goes out on a
+ * single line, the address and dummy bytes on addr_lines and the data on
+ * data_lines.
+ */
+typedef struct {
+    uint8_t cmd;
+    uint8_t addr_lines;
+    uint8_t data_lines;
+    uint8_t dummy_bytes;
+} nlflash_spi_cmd_mode_t;
+
+/* An erase command and the aligned block size it erases, with its typical
+ * time and how long to poll for it to finish.
+ */
+typedef struct {
+    uint32_t size;
+    uint8_t cmd;
+    uint32_t typ_usec;
+    uint32_t retry_cnt;
+    uint32_t retry_delay_ms;
+} nlflash_spi_erase_cmd_t;
+
+/* The part fitted as a device.  Device n uses FLASH_SPI_CHIP(n) if the
+ * product defines it, and otherwise g_flash_spi_chip, which is built from
+ * the chip header, so products with a single part need nothing new.  A
+ * product's config declares its own descriptors before defining e.g.
+ *   extern const struct nlflash_spi_chip_s g_log_flash_chip;
+ *   #define FLASH_SPI_CHIP(n) ((n) == 1 ? &g_log_flash_chip : &g_flash_spi_chip)
+ * With FLASH_SPI_USE_SFDP, each device's size, erase commands, read command
+ * and timings are refined from its chip's SFDP tables on top of these.
+ *
+ * The chip header still supplies what every JEDEC part shares: the WREN,
+ * RDSR, RDID, chip erase and power down commands, the status bits, the
+ * power up timings and page + offset addressing.  Features like
+ * FLASH_SPI_USE_SRAM_BUFFERS, FLASH_SPI_USE_SUSPEND, FLASH_SPI_USE_POWER_MODE
+ * and the quad enable bit are also built in for all devices, so a
+ * descriptor may only use multi line read and program commands if the chip
+ * header's FLASH_SPI_READ_MODE or FLASH_SPI_USE_QUAD_PP does, and each part
+ * must support the features the product enables.  write_size must be at
+ * most FLASH_SPI_MAX_PAGE_SIZE and fast_erase_size / erase_size at most
+ * FLASH_SPI_MAX_SECTORS_PER_BLOCK.
+ */
+typedef struct nlflash_spi_chip_s {
+    nlflash_info_t info;
+    // manufacturer, memory type and density from RDID
+    uint8_t id[3];
+    // in increasing size from info.erase_size to info.fast_erase_size,
+    // each a multiple of the previous one
+    nlflash_spi_erase_cmd_t erase_cmds[3];
+    unsigned num_erase_cmds;
+    nlflash_spi_cmd_mode_t read_cmd_mode;
+    nlflash_spi_cmd_mode_t pp_cmd_mode;
+    uint32_t pp_typ_usec;
+    uint32_t be_typ_usec;
+    uint32_t wrsr_typ_usec;
+} nlflash_spi_chip_t;
+
+/* With FLASH_SPI_NUM_DEVICES > 1, the product defines g_flash_spi_slaves
+ * instead of g_flash_spi_slave.
+ */
 extern const nlspi_slave_t g_flash_spi_slave;
+#if defined(FLASH_SPI_NUM_DEVICES) && (FLASH_SPI_NUM_DEVICES > 1)
+extern const nlspi_slave_t g_flash_spi_slaves[FLASH_SPI_NUM_DEVICES];
+#endif
 extern const nlflash_info_t g_flash_spi_info;
+extern const nlflash_spi_chip_t g_flash_spi_chip;
+
+/* With FLASH_SPI_USE_CLOCK_CALIBRATION, init raises each device's spi clock
+ * above the slave's max_freq_hz while a pattern in the reserved region at
+ * FLASH_SPI_CLOCK_CAL_ADDR keeps reading back intact, or lowers it until the
+ * pattern does if it doesn't at max_freq_hz.  The rate found is kept across
+ * boots through these hooks, which products replace to store it in their
+ * settings; the defaults keep nothing, so every boot calibrates.  A stored
+ * rate is checked with one read of the pattern, and calibrated again if that
+ * fails.  _load() returns -ENOENT if nothing is stored for the device.
+ */
+int nlflash_spi_clock_cal_load(unsigned device, uint32_t *hz);
+int nlflash_spi_clock_cal_store(unsigned device, uint32_t hz);
+
+/* Power mode policies for chips with an L/H switch, like the MX25R. */
+typedef enum {
+    NLFLASH_SPI_POWER_MODE_AUTO,              // high performance while FLASH_SPI_HP_MODE_MIN_BYTES move per window
+    NLFLASH_SPI_POWER_MODE_LOW_POWER,         // always ultra low power
+    NLFLASH_SPI_POWER_MODE_HIGH_PERFORMANCE   // always high performance
+} nlflash_spi_power_mode_t;
+
+/* Functions for device 0 are named nlflash_spi_<op>, device 1
+ * nlflash_spi1_<op> and so on.
+ *
+ * Async reads need FLASH_SPI_USE_ASYNC_READ and a platform that implements
+ * nlspi_transfer_async(); otherwise they return -ENOTSUP.
+ *
+ * Streaming writes need FLASH_SPI_USE_WRITE_STREAM, which adds two pages
+ * of buffer per device; otherwise they return -ENOTSUP.
+ *
+ * With FLASH_SPI_USE_WRITE_VERIFY each page is read back once programmed,
+ * and writes and flushes fail with -EIO if it doesn't match.  A write's
+ * *retlen then stops at the failing page, and _get_verify_failure() returns
+ * that page's address, or -ENOENT if no page has failed since the last call.
+ *
+ * Read sessions need FLASH_SPI_USE_READ_SESSION and a platform that
+ * implements nlspi_transfer_hold(); otherwise they return -ENOTSUP.  Other
+ * operations on the device return -EBUSY while a session is open.
+ *
+ * Power mode policies need FLASH_SPI_USE_POWER_MODE and a chip with an L/H
+ * switch; otherwise _set_power_mode() returns -ENOTSUP.  The default is
+ * NLFLASH_SPI_POWER_MODE_AUTO.
+ *
+ * Preempting reads need FLASH_SPI_USE_SUSPEND and a chip with program/erase
+ * suspend; otherwise they return -EAGAIN.
+ */
+#define NLFLASH_SPI_DECLARE_DEVICE_FUNCS(prefix) \
+int prefix##_init(void); \
+int prefix##_request(void); \
+int prefix##_release(void); \
+const nlflash_info_t *prefix##_get_info(void); \
+int prefix##_read_id(uint8_t *id_buf, size_t id_buf_size); \
+int prefix##_erase(uint32_t addr, size_t len, size_t *retlen, nlloop_callback_fp callback); \
+int prefix##_erase_blank_check(uint32_t addr, size_t len, size_t *retlen, size_t *skipped, nlloop_callback_fp callback); \
+int prefix##_read(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback); \
+int prefix##_write(uint32_t addr, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback); \
+int prefix##_flush(void); \
+int prefix##_flush_range(uint32_t addr, size_t len); \
+int prefix##_write_stream(uint32_t addr, size_t len, size_t *retlen, nlflash_write_producer_t producer, void *context); \
+int prefix##_get_erase_time(uint32_t addr, size_t len, uint32_t *usec); \
+int prefix##_read_async(uint32_t addr, size_t len, uint8_t *buf, nlflash_async_handler_t callback, void *context); \
+int prefix##_read_async_finish(void); \
+int prefix##_read_preempt(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf); \
+int prefix##_get_verify_failure(uint32_t *addr); \
+int prefix##_read_session_begin(uint32_t addr); \
+int prefix##_read_session_read(size_t len, size_t *retlen, uint8_t *buf); \
+int prefix##_read_session_end(void); \
+int prefix##_set_power_mode(nlflash_spi_power_mode_t mode); \
+int prefix##_write_start(uint32_t addr, size_t len, const uint8_t *buf); \
+int prefix##_write_finish(void); \
+int prefix##_erase_start(uint32_t addr, size_t len); \
+int prefix##_erase_finish(void); \
+int prefix##_readv(uint32_t addr, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen); \
+int prefix##_writev(uint32_t addr, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen);
 
-int nlflash_spi_init(void);
-int nlflash_spi_request(void);
-int nlflash_spi_release(void);
-const nlflash_info_t *nlflash_spi_get_info(void);
-int nlflash_spi_read_id(uint8_t *id_buf, size_t id_buf_size);
-int nlflash_spi_erase(uint32_t addr, size_t len, size_t *retlen, nlloop_callback_fp callback);
-int nlflash_spi_read(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback);
-int nlflash_spi_write(uint32_t addr, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback);
-int nlflash_spi_flush(void);
+/* Initializer for a device's g_flash_device_table entry, e.g.
+ *   [NLFLASH_LOG] = NLFLASH_SPI_FUNC_TABLE(nlflash_spi1),
+ */
+#define NLFLASH_SPI_FUNC_TABLE(prefix) \
+{ \
+    .init = prefix##_init, \
+    .request = prefix##_request, \
+    .release = prefix##_release, \
+    .flush = prefix##_flush, \
+    .read_id = prefix##_read_id, \
+    .get_info = prefix##_get_info, \
+    .erase = prefix##_erase, \
+    .read = prefix##_read, \
+    .write = prefix##_write, \
+    .read_async = prefix##_read_async, \
+    .read_async_finish = prefix##_read_async_finish, \
+    .get_erase_time = prefix##_get_erase_time, \
+    .erase_blank_check = prefix##_erase_blank_check, \
+    .read_preempt = prefix##_read_preempt, \
+    .flush_range = prefix##_flush_range, \
+    .write_stream = prefix##_write_stream, \
+    .read_session_begin = prefix##_read_session_begin, \
+    .read_session_read = prefix##_read_session_read, \
+    .read_session_end = prefix##_read_session_end, \
+    .write_start = prefix##_write_start, \
+    .write_finish = prefix##_write_finish, \
+    .erase_start = prefix##_erase_start, \
+    .erase_finish = prefix##_erase_finish, \
+    .readv = prefix##_readv, \
+    .writev = prefix##_writev, \
+}
+
+NLFLASH_SPI_DECLARE_DEVICE_FUNCS(nlflash_spi)
+#if defined(FLASH_SPI_NUM_DEVICES) && (FLASH_SPI_NUM_DEVICES > 1)
+NLFLASH_SPI_DECLARE_DEVICE_FUNCS(nlflash_spi1)
+#endif
+#if defined(FLASH_SPI_NUM_DEVICES) && (FLASH_SPI_NUM_DEVICES > 2)
+NLFLASH_SPI_DECLARE_DEVICE_FUNCS(nlflash_spi2)
+#endif
+#if defined(FLASH_SPI_NUM_DEVICES) && (FLASH_SPI_NUM_DEVICES > 3)
+NLFLASH_SPI_DECLARE_DEVICE_FUNCS(nlflash_spi3)
+#endif
 
 #ifdef __cplusplus
 }
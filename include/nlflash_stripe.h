@@ -0,0 +1,85 @@
+/*
+ *
+ *    Copyright (c) 2018 Nest Labs, Inc.
+ *    All rights reserved.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ *    Description:
+ *      This file defines an API for a flash striped across two
+ *      flash devices, for twice the write throughput of one.
+ *
+ */
+
+#ifndef __NLFLASH_STRIPE_H_INCLUDED__
+#define __NLFLASH_STRIPE_H_INCLUDED__
+
+#include <nlplatform/nlflash.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* The striped flash's write_size pages alternate between the two devices,
+ * which must have the same geometry: even pages are on ids[0] and odd pages
+ * on ids[1].  A write programs a page on each device at a time, concurrently
+ * when the devices have write_start/write_finish.  Each erase_size block is
+ * the same erase block on both devices, so it's twice theirs, and an erase
+ * erases each block on both devices at once when they have
+ * erase_start/erase_finish.
+ *
+ * The striped flash's g_flash_device_table entry must follow both devices'
+ * so they're initialized first.  Nothing else should use the devices.
+ */
+typedef struct {
+    const char *name;
+    nlflash_id_t ids[2];
+} nlflash_stripe_config_t;
+
+extern const nlflash_stripe_config_t g_flash_stripe_config;
+
+int nlflash_stripe_init(void);
+int nlflash_stripe_request(void);
+int nlflash_stripe_release(void);
+int nlflash_stripe_flush(void);
+int nlflash_stripe_flush_range(uint32_t addr, size_t len);
+const nlflash_info_t *nlflash_stripe_get_info(void);
+int nlflash_stripe_erase(uint32_t addr, size_t len, size_t *retlen, nlloop_callback_fp callback);
+int nlflash_stripe_read(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback);
+int nlflash_stripe_write(uint32_t addr, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback);
+int nlflash_stripe_get_erase_time(uint32_t addr, size_t len, uint32_t *usec);
+
+/* Initializer for the striped flash's g_flash_device_table entry, e.g.
+ *   [NLFLASH_RECORDING] = NLFLASH_STRIPE_FUNC_TABLE,
+ */
+#define NLFLASH_STRIPE_FUNC_TABLE \
+{ \
+    .init = nlflash_stripe_init, \
+    .request = nlflash_stripe_request, \
+    .release = nlflash_stripe_release, \
+    .flush = nlflash_stripe_flush, \
+    .get_info = nlflash_stripe_get_info, \
+    .erase = nlflash_stripe_erase, \
+    .read = nlflash_stripe_read, \
+    .write = nlflash_stripe_write, \
+    .get_erase_time = nlflash_stripe_get_erase_time, \
+    .flush_range = nlflash_stripe_flush_range, \
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __NLFLASH_STRIPE_H_INCLUDED__ */
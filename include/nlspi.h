@@ -25,6 +25,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -107,6 +108,31 @@ typedef struct nlspi_transfer_s {
 } nlspi_transfer_t;
 int nlspi_transfer(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, unsigned num_transfers);
 
+/* Number of data lines used for a transfer by nlspi_transfer_lines() */
+#define NLSPI_LINES_SINGLE  1
+#define NLSPI_LINES_DUAL    2
+#define NLSPI_LINES_QUAD    4
+
+/* Multi-line variant of nlspi_transfer(), for devices like SPI flash that
+ * switch to dual or quad I/O partway through a command.  lines[i] is the
+ * number of data lines (NLSPI_LINES_*) to use for transfers[i].  Dual and
+ * quad transfers are half duplex, so only one of tx and rx may be set.
+ * Controllers (or boards) without the extra lines return -ENOTSUP for any
+ * transfer wider than NLSPI_LINES_SINGLE.
+ */
+int nlspi_transfer_lines(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, const uint8_t *lines,
+                         unsigned num_transfers);
+
+/* Like nlspi_transfer_lines(), but if hold_cs is true CS stays asserted
+ * after the transfers, so the next call continues the same command (e.g. to
+ * keep clocking data out of a flash read).  The call with hold_cs false
+ * deasserts CS; num_transfers may be 0 to only do that.  lines may be NULL
+ * if all transfers are single line.  The caller must hold the controller
+ * (nlspi_request()) from the first call until CS is deasserted.
+ */
+int nlspi_transfer_hold(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, const uint8_t *lines,
+                        unsigned num_transfers, bool hold_cs);
+
 /* Asynchronous uni-directional read/write APIs */
 
 /* result == 0 on successful completion of transfer, < 0 on error */
@@ -120,6 +146,18 @@ int nlspi_read_async(const nlspi_slave_t *slave, uint8_t *buf, size_t len,
 int nlspi_write_async(const nlspi_slave_t *slave, const uint8_t *buf, size_t len,
                       nlspi_async_handler_t callback);
 
+/* Asynchronous bi-directional transfers.  Like nlspi_transfer(), CS stays
+ * asserted across the whole array of transfers, but the call returns once
+ * the transfers have been queued and the controller streams them (using DMA
+ * where available).  The transfer array and buffers must stay valid until
+ * callback is invoked.  Per-transfer callbacks are not supported and must be
+ * NULL.  The caller must hold the controller (nlspi_request()) until the
+ * callback has been invoked.
+ * returns 0 on successful start of transfer, < 0 on error
+ */
+int nlspi_transfer_async(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, unsigned num_transfers,
+                         nlspi_async_handler_t callback);
+
 #ifdef __cplusplus
 }
 #endif
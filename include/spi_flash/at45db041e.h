@@ -35,6 +35,19 @@
 */
 //#define FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
 
+/* Uncomment the following if the RDY/BUSY# pin is wired to a gpio, given by
+   FLASH_SPI_READY_GPIO(n) in nlproduct_config.h, to wait for program and
+   erase on the pin instead of polling the status register.
+*/
+//#define FLASH_SPI_USE_READY_GPIO
+
+/* Uncomment the following to program through the chip's two SRAM buffers
+   instead of with page program: one buffer is loaded while the other is
+   committed to main memory.  Commits use built-in erase, so pages are
+   replaced rather than ANDed with their old contents.
+*/
+//#define FLASH_SPI_USE_SRAM_BUFFERS
+
 /* spi bus, spi freq, and chip select pin should be defined in nlproduct_config.h */
 #define AT45DB041E_MAX_SPI_FREQ_HZ  (85000000)              // 85MHz
 #define FLASH_SPI_MODE              (SPI_MODE_0)
@@ -75,6 +88,14 @@
 #define CMD_BE                      (0xC7) /* bulk erase: "bulk erase" is called "chip erase" on AT45 */
 #define CMD_BE_ADDR                 (0x94809A) /* chip erase needs these three additional opcode bytes, we send it as "addr" */
 
+// SRAM buffer commands, used with FLASH_SPI_USE_SRAM_BUFFERS
+#define CMD_BUF1_WRITE              (0x84) /* write data to buffer 1 at a buffer offset */
+#define CMD_BUF2_WRITE              (0x87) /* write data to buffer 2 at a buffer offset */
+#define CMD_BUF1_PP_ERASE           (0x83) /* buffer 1 to main memory page program with built-in erase */
+#define CMD_BUF2_PP_ERASE           (0x86) /* buffer 2 to main memory page program with built-in erase */
+#define CMD_PAGE_TO_BUF1            (0x53) /* main memory page to buffer 1 transfer */
+#define CMD_PAGE_TO_BUF2            (0x55) /* main memory page to buffer 2 transfer */
+
 // Read device ID
 #define CMD_RDID                    (0x9F) /* read device ID */
 
@@ -96,6 +117,18 @@
 #define SE_DELAY_LOOP_COUNT         (20) /* SectorErase64K Typ. 700ms, Max. 1100ms */
 #define SSE_DELAY_MSEC              (10)
 #define SSE_DELAY_LOOP_COUNT        (5)  /* SubSectorErase2K Typ. 30ms, Max. 35ms */
+#define BUF_PP_DELAY_MSEC           (5)
+#define BUF_PP_DELAY_LOOP_COUNT     (8)  /* PageEraseAndProgram Typ. 12ms, Max. 35ms */
+#define BUF_LOAD_DELAY_MSEC         (1)
+#define BUF_LOAD_DELAY_LOOP_COUNT   (2)  /* PageToBufferTransfer Max. 200us */
+
+/* typical time for different operations, used to seed adaptive busy polling */
+#define PP_TYP_USEC                 (1500)
+#define BE_TYP_USEC                 (6000000)
+#define SE_TYP_USEC                 (700000)
+#define SSE_TYP_USEC                (30000)
+#define BUF_PP_TYP_USEC             (12000)
+#define BUF_LOAD_TYP_USEC           (200)
 
 /* These values are based on the data sheet but a product
  * might want to use longer values based on how the chip
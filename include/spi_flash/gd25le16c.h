@@ -97,7 +97,10 @@
 #define CMD_PP                      (0x02) /* to program the selected page */
 #define CMD_SSE                     (0x20) /* subsector erase: "4K subsector" is called "sector" on MX25 */
 #define CMD_SE                      (0xD8) /* sector erase: "64K sector" is called "block" on MX25 */
+#define CMD_BE32K                   (0x52) /* block erase: "32K block" on MX25, erases half a sector */
 #define CMD_BE                      (0xC7) /* bulk erase: "bulk erase" is called "chip erase" on MX25 */
+#define CMD_SUSPEND                 (0x75) /* suspend a program or erase in progress */
+#define CMD_RESUME                  (0x7A) /* resume a suspended program or erase */
 
 /* Read device ID */
 #define CMD_RDID                    (0x9F) /* read device ID */
@@ -114,7 +117,17 @@
 #define BE_DELAY_LOOP_COUNT         (21) /* ChipErase Typ./Max.: 5s/10s */
 #define SE_DELAY_MSEC               (75)
 #define SE_DELAY_LOOP_COUNT         (15)  /* BlockErase64K Typ./Max.: 0.18s/1s */
+#define BE32K_DELAY_MSEC            (50)
+#define BE32K_DELAY_LOOP_COUNT      (16)  /* BlockErase32K Typ./Max.: 0.15s/0.8s */
 #define SSE_DELAY_MSEC              (10)
 #define SSE_DELAY_LOOP_COUNT        (35)  /* SectorErase4K Typ./Max.: 40ms/300ms */
 
+/* typical time for different operations, used to seed adaptive busy polling */
+#define PP_TYP_USEC                 (700)
+#define BE_TYP_USEC                 (5000000)
+#define SE_TYP_USEC                 (180000)
+#define BE32K_TYP_USEC              (150000)
+#define SSE_TYP_USEC                (40000)
+#define SUSPEND_LATENCY_USEC        (40)  /* Program/Erase Suspend latency Max. 40us */
+
 #endif /* __GD25LE16C_H_INCLUDED__ */
@@ -35,6 +35,23 @@
 */
 //#define FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
 
+/* Uncomment one of the following to read using two or four data lines, and
+   FLASH_SPI_USE_QUAD_PP to page program using four.  Quad modes need IO2/IO3
+   wired to a controller that supports them; the driver sets the
+   non-volatile M_STAT_QE bit on first use.
+*/
+//#define FLASH_SPI_READ_MODE FLASH_SPI_READ_MODE_DUAL_OUTPUT
+//#define FLASH_SPI_READ_MODE FLASH_SPI_READ_MODE_QUAD_OUTPUT
+//#define FLASH_SPI_READ_MODE FLASH_SPI_READ_MODE_QUAD_IO
+//#define FLASH_SPI_USE_QUAD_PP
+
+/* Uncomment the following to switch the chip into high performance mode
+   while a lot of data is moving (see FLASH_SPI_HP_MODE_MIN_BYTES) and back
+   into ultra low power mode otherwise.  The spi clock must be within the
+   low power mode limits.
+*/
+//#define FLASH_SPI_USE_POWER_MODE
+
 /* Try for 20 msec to read chip ID. Reading a valid chip ID indicates the flash
  * is ready for interaction. Micron says the flash should complete all internal
  * processes and return a valid chip ID within 17 msec.
@@ -58,6 +75,9 @@
 
 #define FLASH_SPI_FAST_READ_DUMMY_CYCLES    (1) /* default number of dummy cycles is 1 byte when using FAST_READ */
 #define FLASH_SPI_READ_DUMMY_CYCLES         (0) /* default number of dummy cycles is 0 byte when using regular READ */
+#define FLASH_SPI_DREAD_DUMMY_CYCLES        (1) /* 8 dummy clocks on one line when using DREAD */
+#define FLASH_SPI_QREAD_DUMMY_CYCLES        (1) /* 8 dummy clocks on one line when using QREAD */
+#define FLASH_SPI_4READ_DUMMY_CYCLES        (3) /* 6 dummy clocks on four lines when using 4READ */
 #define FLASH_SPI_FAST_READ_FREQ_HZ         (80000000)     /* 80MHz */
 #define FLASH_SPI_READ_FREQ_HZ              (33000000)     /* 33MHz */
 
@@ -76,6 +96,10 @@
 #define M_STAT_READY_VALUE  (0<<0) /* value of busy bit to indicate device is ready */
 #define M_STAT_BUSY_VALUE   (1<<0) /* value of busy bit to indicate device is busy */
 
+/* Configuration registers, read by RDCR and written by WRSR after the status reg */
+#define CMD_RDCR            (0x15) /* to read out configuration regs 1 and 2 */
+#define M_CR2_HP_MODE       (1<<1) /* L/H switch, set for high performance mode */
+
 /* Register/Setting Commands */
 #define CMD_WREN                    (0x06) /* write enable */
 #define CMD_WRDI                    (0x04) /* write disable */
@@ -86,11 +110,18 @@
 /* Read/Write Array Commands */
 #define CMD_READ                    (0x03) /* max speed 33 MHz */
 #define CMD_FAST_READ               (0x0B) /* max speed 80 MHz */
+#define CMD_DREAD                   (0x3B) /* cmd+addr on one line, data on two */
+#define CMD_QREAD                   (0x6B) /* cmd+addr on one line, data on four */
+#define CMD_4READ                   (0xEB) /* cmd on one line, addr+data on four */
 
 #define CMD_PP                      (0x02) /* to program the selected page */
+#define CMD_4PP                     (0x38) /* quad page program: cmd on one line, addr+data on four */
 #define CMD_SSE                     (0x20) /* subsector erase: "4K subsector" is called "sector" on MX25 */
 #define CMD_SE                      (0xD8) /* sector erase: "64K sector" is called "block" on MX25 */
+#define CMD_BE32K                   (0x52) /* block erase: "32K block" on MX25, erases half a sector */
 #define CMD_BE                      (0xC7) /* bulk erase: "bulk erase" is called "chip erase" on MX25 */
+#define CMD_SUSPEND                 (0xB0) /* suspend a program or erase in progress */
+#define CMD_RESUME                  (0x30) /* resume a suspended program or erase */
 
 /* Read device ID */
 #define CMD_RDID                    (0x9F) /* read device ID */
@@ -107,7 +138,19 @@
 #define BE_DELAY_LOOP_COUNT         (15)  /* ChipErase Typ. 50s, Max. 150s */
 #define SE_DELAY_MSEC               (75)
 #define SE_DELAY_LOOP_COUNT         (50)  /* BlockErase64K Typ. 480ms, Max. 3000ms */
+#define BE32K_DELAY_MSEC            (50)
+#define BE32K_DELAY_LOOP_COUNT      (30)  /* BlockErase32K Typ. 240ms, Max. 1500ms */
 #define SSE_DELAY_MSEC              (10)
 #define SSE_DELAY_LOOP_COUNT        (30)  /* SectorErase4K Typ. 40ms, Max. 240ms */
+#define WRSR_DELAY_MSEC             (5)
+#define WRSR_DELAY_LOOP_COUNT       (8)   /* WriteStatusRegister Max. 40ms */
+
+/* typical time for different operations, used to seed adaptive busy polling */
+#define PP_TYP_USEC                 (850)
+#define BE_TYP_USEC                 (50000000)
+#define SE_TYP_USEC                 (480000)
+#define BE32K_TYP_USEC              (240000)
+#define SSE_TYP_USEC                (40000)
+#define SUSPEND_LATENCY_USEC        (20)  /* Erase/Program Suspend latency Max. 20us */
 
 #endif /* __MX25R6435_H_INCLUDED__ */
@@ -24,21 +24,402 @@
 
 #include <nlassert.h>
 #include <errno.h>
+#include <string.h>
 #include <nlplatform.h>
 
 #if NL_NUM_FLASH_IDS > 0
 
 #include <nlplatform/nlflash.h>
+#include <nlutilities.h>
+#include <nlplatform/nltime.h>
+
+// bytes read at a time by the generic blank check
+#ifndef NLFLASH_BLANK_CHECK_BUFFER_SIZE
+#define NLFLASH_BLANK_CHECK_BUFFER_SIZE 64
+#endif
+
+// bytes produced at a time by nlflash_write_stream() on flash that
+// can't stream writes itself
+#ifndef NLFLASH_WRITE_STREAM_BUFFER_SIZE
+#define NLFLASH_WRITE_STREAM_BUFFER_SIZE 64
+#endif
+
+// bytes compared at a time by nlflash_copy() when skipping destination
+// pages that already match; two of these are on the stack
+#ifndef NLFLASH_COPY_BUFFER_SIZE
+#define NLFLASH_COPY_BUFFER_SIZE 64
+#endif
+
+// blocks in the read cache shared by the flash it's enabled for; 0 leaves
+// the cache out
+#ifndef NLFLASH_CACHE_NUM_BLOCKS
+#define NLFLASH_CACHE_NUM_BLOCKS 0
+#endif
+
+#if NLFLASH_CACHE_NUM_BLOCKS > 0
+#ifndef NLFLASH_CACHE_BLOCK_SIZE
+#define NLFLASH_CACHE_BLOCK_SIZE 256
+#endif
+// longer reads go straight to the flash rather than evict the whole cache
+#ifndef NLFLASH_CACHE_MAX_READ_SIZE
+#define NLFLASH_CACHE_MAX_READ_SIZE NLFLASH_CACHE_BLOCK_SIZE
+#endif
+#endif
 
 typedef struct
 {
     int (* lock)(void *);
     int (* unlock)(void *);
     void *lock_ctx;
+    int async_result;
+    // the read in progress went to the driver's read_async
+    bool async_in_driver;
+    // next address to read, for read sessions on flash without them
+    uint32_t session_addr;
+#if NLFLASH_CACHE_NUM_BLOCKS > 0
+    bool cache_enabled;
+#endif
+#ifdef NLFLASH_USE_STATS
+    // only changed with the lock held
+    nlflash_stats_t stats;
+    // nlflash_lock() nesting, and the wait for the outermost lock until
+    // the first operation under it records it
+    unsigned lock_depth;
+    bool lock_wait_pending;
+    nltime_system_64_t lock_wait_ms;
+#endif
 } flash_ctx_t;
 
+// an operation being timed for the stats
+typedef struct
+{
+    nltime_system_64_t start_ms;
+    bool requested;
+} flash_stats_op_t;
+
 static flash_ctx_t s_flash_ctxs[NL_NUM_FLASH_IDS];
 
+#if NLFLASH_CACHE_NUM_BLOCKS > 0
+// Blocks are filled by reads and dropped by writes, erases and flushes, so
+// they're never dirty.  Each flash id has its own lock, so block metadata
+// is only changed with interrupts disabled, and a block in use by a read
+// isn't replaced.
+typedef struct
+{
+    uint32_t addr;
+    uint32_t last_use;
+    nlflash_id_t flash_id;
+    uint8_t users;
+    bool valid;
+    uint32_t data[NLFLASH_CACHE_BLOCK_SIZE / sizeof(uint32_t)];
+} flash_cache_block_t;
+
+static flash_cache_block_t s_cache_blocks[NLFLASH_CACHE_NUM_BLOCKS];
+static uint32_t s_cache_clock;
+static nlflash_cache_stats_t s_cache_stats;
+
+// Get the block caching block_addr, or claim the least recently used free
+// block for it, setting *hit accordingly.  Returns NULL if every block is
+// in use.  The block must be handed back with cache_put().
+static flash_cache_block_t *cache_get(nlflash_id_t flash_id, uint32_t block_addr, bool *hit)
+{
+    flash_cache_block_t *block = NULL;
+    flash_cache_block_t *victim = NULL;
+    unsigned i;
+
+    nlplatform_interrupt_disable();
+
+    for (i = 0; i < NLFLASH_CACHE_NUM_BLOCKS; i++)
+    {
+        flash_cache_block_t *b = &s_cache_blocks[i];
+
+        if (b->valid && (b->flash_id == flash_id) && (b->addr == block_addr))
+        {
+            block = b;
+            break;
+        }
+        if ((b->users == 0) &&
+            ((victim == NULL) || !b->valid ||
+             (victim->valid && (s_cache_clock - b->last_use > s_cache_clock - victim->last_use))))
+        {
+            victim = b;
+        }
+    }
+
+    *hit = (block != NULL);
+    if (*hit)
+    {
+        s_cache_stats.hits++;
+    }
+    else
+    {
+        s_cache_stats.misses++;
+        block = victim;
+        if (block != NULL)
+        {
+            block->valid = false;
+            block->flash_id = flash_id;
+            block->addr = block_addr;
+        }
+    }
+    if (block != NULL)
+    {
+        block->users++;
+        block->last_use = ++s_cache_clock;
+    }
+
+    nlplatform_interrupt_enable();
+
+    return block;
+}
+
+static void cache_put(flash_cache_block_t *block, bool filled)
+{
+    nlplatform_interrupt_disable();
+    if (filled)
+    {
+        block->valid = true;
+    }
+    block->users--;
+    nlplatform_interrupt_enable();
+}
+
+static bool cache_covers(nlflash_id_t flash_id, uint32_t from, size_t len)
+{
+    const nlflash_info_t *info;
+
+    if (!s_flash_ctxs[flash_id].cache_enabled || (len > NLFLASH_CACHE_MAX_READ_SIZE))
+    {
+        return false;
+    }
+
+    // blocks past the end of the flash can't be filled
+    info = g_flash_device_table[flash_id].get_info();
+    return (from <= info->size) && (len <= info->size - from);
+}
+
+// Read through the cache a block at a time.  Called with the lock held.
+static int cache_read(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen, uint8_t *buf)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    const uint32_t size = table->get_info()->size;
+    int retval = 0;
+
+    *retlen = 0;
+
+    while (*retlen < len)
+    {
+        uint32_t addr = from + *retlen;
+        uint32_t block_addr = ROUNDDOWN(addr, NLFLASH_CACHE_BLOCK_SIZE);
+        size_t offset = addr - block_addr;
+        size_t chunk = MIN(NLFLASH_CACHE_BLOCK_SIZE - offset, len - *retlen);
+        size_t read_retlen;
+        bool hit;
+        flash_cache_block_t *block = cache_get(flash_id, block_addr, &hit);
+
+        if (block == NULL)
+        {
+            retval = table->read(addr, chunk, &read_retlen, buf + *retlen, NULL);
+        }
+        else
+        {
+            if (!hit)
+            {
+                retval = table->read(block_addr, MIN(NLFLASH_CACHE_BLOCK_SIZE, size - block_addr), &read_retlen,
+                                     (uint8_t *)block->data, NULL);
+            }
+            if (retval >= 0)
+            {
+                memcpy(buf + *retlen, (uint8_t *)block->data + offset, chunk);
+            }
+            cache_put(block, retval >= 0);
+        }
+
+        if (retval < 0)
+        {
+            break;
+        }
+        *retlen += chunk;
+    }
+
+    return retval;
+}
+#else /* NLFLASH_CACHE_NUM_BLOCKS == 0 */
+static bool cache_covers(nlflash_id_t flash_id, uint32_t from, size_t len)
+{
+    return false;
+}
+
+static int cache_read(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen, uint8_t *buf)
+{
+    return -ENOTSUP;
+}
+#endif /* NLFLASH_CACHE_NUM_BLOCKS > 0 */
+
+void nlflash_cache_invalidate(nlflash_id_t flash_id, uint32_t addr, size_t len)
+{
+#if NLFLASH_CACHE_NUM_BLOCKS > 0
+    unsigned i;
+
+    nlplatform_interrupt_disable();
+    for (i = 0; i < NLFLASH_CACHE_NUM_BLOCKS; i++)
+    {
+        flash_cache_block_t *b = &s_cache_blocks[i];
+
+        if ((b->flash_id == flash_id) && (b->addr < addr + len) && (addr < b->addr + NLFLASH_CACHE_BLOCK_SIZE))
+        {
+            b->valid = false;
+        }
+    }
+    nlplatform_interrupt_enable();
+#endif
+}
+
+int nlflash_cache_enable(nlflash_id_t flash_id, bool enable)
+{
+#if NLFLASH_CACHE_NUM_BLOCKS > 0
+    int retval = nlflash_lock(flash_id);
+
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    s_flash_ctxs[flash_id].cache_enabled = enable;
+    if (!enable)
+    {
+        nlflash_cache_invalidate(flash_id, 0, UINT32_MAX);
+    }
+
+    return nlflash_unlock(flash_id);
+#else
+    return -ENOTSUP;
+#endif
+}
+
+void nlflash_cache_get_stats(nlflash_cache_stats_t *stats)
+{
+#if NLFLASH_CACHE_NUM_BLOCKS > 0
+    nlplatform_interrupt_disable();
+    *stats = s_cache_stats;
+    nlplatform_interrupt_enable();
+#else
+    memset(stats, 0, sizeof(*stats));
+#endif
+}
+
+void nlflash_cache_reset_stats(void)
+{
+#if NLFLASH_CACHE_NUM_BLOCKS > 0
+    nlplatform_interrupt_disable();
+    memset(&s_cache_stats, 0, sizeof(s_cache_stats));
+    nlplatform_interrupt_enable();
+#endif
+}
+
+#ifdef NLFLASH_USE_STATS
+// the system clock only has ms resolution, so the buckets are in ms
+static void stats_record_latency(nlflash_id_t flash_id, nlflash_stats_latency_t latency, nltime_system_64_t msec)
+{
+    unsigned bucket = 0;
+
+    while ((msec > 0) && (bucket < NLFLASH_STATS_NUM_BUCKETS - 1))
+    {
+        msec >>= 1;
+        bucket++;
+    }
+    s_flash_ctxs[flash_id].stats.latency[latency][bucket]++;
+}
+
+// Start timing an operation, after taking the lock.  With request, the
+// flash is requested here, so the time it takes to power up is recorded
+// apart from the operation's, and stays requested until stats_op_end().
+static void stats_op_begin(nlflash_id_t flash_id, flash_stats_op_t *op, bool request)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    flash_ctx_t *ctx = &s_flash_ctxs[flash_id];
+
+    // nested operations, e.g. in nlflash_transact(), share one lock wait
+    if (ctx->lock_wait_pending)
+    {
+        stats_record_latency(flash_id, NLFLASH_STATS_LOCK_WAIT, ctx->lock_wait_ms);
+        ctx->lock_wait_pending = false;
+    }
+
+    op->requested = false;
+    if (request && (table->request != NULL))
+    {
+        nltime_system_64_t start_ms = nltime_get_system_ms();
+
+        // on failure the operation's own request reports the error
+        op->requested = (table->request() >= 0);
+        stats_record_latency(flash_id, NLFLASH_STATS_REQUEST, nltime_get_system_ms() - start_ms);
+    }
+    op->start_ms = nltime_get_system_ms();
+}
+
+static void stats_op_end(nlflash_id_t flash_id, const flash_stats_op_t *op, nlflash_stats_op_t kind,
+                         size_t bytes, int retval)
+{
+    nlflash_stats_t *stats = &s_flash_ctxs[flash_id].stats;
+
+    stats_record_latency(flash_id, NLFLASH_STATS_OP_TIME, nltime_get_system_ms() - op->start_ms);
+    stats->ops[kind]++;
+    stats->bytes[kind] += bytes;
+    if (retval < 0)
+    {
+        stats->errors[kind]++;
+    }
+
+    if (op->requested && (g_flash_device_table[flash_id].release != NULL))
+    {
+        g_flash_device_table[flash_id].release();
+    }
+}
+
+int nlflash_get_stats(nlflash_id_t flash_id, nlflash_stats_t *stats)
+{
+    int retval;
+
+    retval = nlflash_lock(flash_id);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    *stats = s_flash_ctxs[flash_id].stats;
+
+    return nlflash_unlock(flash_id);
+}
+
+void nlflash_reset_stats(nlflash_id_t flash_id)
+{
+    if (nlflash_lock(flash_id) >= 0)
+    {
+        memset(&s_flash_ctxs[flash_id].stats, 0, sizeof(s_flash_ctxs[flash_id].stats));
+        nlflash_unlock(flash_id);
+    }
+}
+#else /* !defined(NLFLASH_USE_STATS) */
+static void stats_op_begin(nlflash_id_t flash_id, flash_stats_op_t *op, bool request)
+{
+}
+
+static void stats_op_end(nlflash_id_t flash_id, const flash_stats_op_t *op, nlflash_stats_op_t kind,
+                         size_t bytes, int retval)
+{
+}
+
+int nlflash_get_stats(nlflash_id_t flash_id, nlflash_stats_t *stats)
+{
+    return -ENOTSUP;
+}
+
+void nlflash_reset_stats(nlflash_id_t flash_id)
+{
+}
+#endif /* defined(NLFLASH_USE_STATS) */
+
 static bool erase_alignment_is_ok(nlflash_id_t flash_id, uint32_t start, size_t len)
 {
     const nlflash_info_t *flash_info = nlflash_get_info(flash_id);
@@ -59,7 +440,23 @@ int nlflash_lock(nlflash_id_t flash_id)
 {
     if (s_flash_ctxs[flash_id].lock != NULL)
     {
+#ifdef NLFLASH_USE_STATS
+        flash_ctx_t *ctx = &s_flash_ctxs[flash_id];
+        nltime_system_64_t start_ms = nltime_get_system_ms();
+        int retval = ctx->lock(ctx->lock_ctx);
+
+        // only the outermost lock waits; it's recorded by the first
+        // counted operation under it, so stats queries and other
+        // internal locking aren't
+        if ((retval >= 0) && (++ctx->lock_depth == 1))
+        {
+            ctx->lock_wait_ms = nltime_get_system_ms() - start_ms;
+            ctx->lock_wait_pending = true;
+        }
+        return retval;
+#else
         return s_flash_ctxs[flash_id].lock(s_flash_ctxs[flash_id].lock_ctx);
+#endif
     }
 
     return 0;
@@ -69,6 +466,12 @@ int nlflash_unlock(nlflash_id_t flash_id)
 {
     if (s_flash_ctxs[flash_id].unlock != NULL)
     {
+#ifdef NLFLASH_USE_STATS
+        if ((s_flash_ctxs[flash_id].lock_depth > 0) && (--s_flash_ctxs[flash_id].lock_depth == 0))
+        {
+            s_flash_ctxs[flash_id].lock_wait_pending = false;
+        }
+#endif
         return s_flash_ctxs[flash_id].unlock(s_flash_ctxs[flash_id].lock_ctx);
     }
 
@@ -125,6 +528,83 @@ int nlflash_release(nlflash_id_t flash_id)
     return retval;
 }
 
+int nlflash_begin(nlflash_id_t flash_id)
+{
+    int retval;
+
+    retval = nlflash_lock(flash_id);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    // the lock is recursive and requests are counted, so the calls in the
+    // batch only take and drop them again
+    if (g_flash_device_table[flash_id].request != NULL)
+    {
+        retval = g_flash_device_table[flash_id].request();
+        if (retval < 0)
+        {
+            nlflash_unlock(flash_id);
+        }
+    }
+
+    return retval;
+}
+
+int nlflash_end(nlflash_id_t flash_id)
+{
+    return nlflash_release(flash_id);
+}
+
+int nlflash_transact(nlflash_id_t flash_id, nlflash_op_t *ops, unsigned num_ops)
+{
+    int retval;
+    int end_retval;
+    unsigned i;
+
+    for (i = 0; i < num_ops; i++)
+    {
+        ops[i].retlen = 0;
+    }
+
+    retval = nlflash_begin(flash_id);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    for (i = 0; (i < num_ops) && (retval >= 0); i++)
+    {
+        switch (ops[i].type)
+        {
+            case NLFLASH_OP_READ:
+                retval = nlflash_read(flash_id, ops[i].addr, ops[i].len, &ops[i].retlen, ops[i].buf, NULL);
+                break;
+
+            case NLFLASH_OP_WRITE:
+                retval = nlflash_write(flash_id, ops[i].addr, ops[i].len, &ops[i].retlen, ops[i].buf, NULL);
+                break;
+
+            case NLFLASH_OP_ERASE:
+                retval = nlflash_erase(flash_id, ops[i].addr, ops[i].len, &ops[i].retlen, NULL);
+                break;
+
+            default:
+                retval = -EINVAL;
+                break;
+        }
+    }
+
+    end_retval = nlflash_end(flash_id);
+    if ((end_retval < 0) && (retval >= 0))
+    {
+        retval = end_retval;
+    }
+
+    return retval;
+}
+
 int nlflash_flush(nlflash_id_t flash_id)
 {
     int retval;
@@ -143,6 +623,37 @@ int nlflash_flush(nlflash_id_t flash_id)
     }
 
     retval = g_flash_device_table[flash_id].flush();
+    // flushed data is new to the cache too
+    nlflash_cache_invalidate(flash_id, 0, UINT32_MAX);
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+int nlflash_flush_range(nlflash_id_t flash_id, uint32_t addr, size_t len)
+{
+    int retval;
+    int lock_retval;
+
+    // flash without flush_range flushes everything
+    if (g_flash_device_table[flash_id].flush_range == NULL)
+    {
+        return nlflash_flush(flash_id);
+    }
+
+    lock_retval = nlflash_lock(flash_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+
+    retval = g_flash_device_table[flash_id].flush_range(addr, len);
+    nlflash_cache_invalidate(flash_id, addr, len);
 
     lock_retval = nlflash_unlock(flash_id);
     if ((lock_retval < 0) && (retval >= 0))
@@ -208,6 +719,7 @@ const nlflash_info_t *nlflash_get_info(nlflash_id_t flash_id)
 
 int nlflash_erase(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen, nlloop_callback_fp callback)
 {
+    flash_stats_op_t op;
     int retval;
     int lock_retval;
 
@@ -223,7 +735,11 @@ int nlflash_erase(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retl
         return lock_retval;
     }
 
+    stats_op_begin(flash_id, &op, true);
+    *retlen = 0;
     retval = g_flash_device_table[flash_id].erase(from, len, retlen, callback);
+    stats_op_end(flash_id, &op, NLFLASH_STATS_ERASE, *retlen, retval);
+    nlflash_cache_invalidate(flash_id, from, len);
 
     lock_retval = nlflash_unlock(flash_id);
     if ((lock_retval < 0) && (retval >= 0))
@@ -234,39 +750,186 @@ int nlflash_erase(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retl
     return retval;
 }
 
-int nlflash_read(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback)
+bool nlflash_buf_is_blank(const void *buf, size_t len)
 {
-    int retval;
-    int lock_retval;
+    const uint32_t *words = buf;
+    const uint8_t *bytes;
 
-    // read is not optional
-    nlASSERT(g_flash_device_table[flash_id].read != NULL);
+    while (len >= sizeof(*words))
+    {
+        if (*words++ != 0xFFFFFFFF)
+        {
+            return false;
+        }
+        len -= sizeof(*words);
+    }
 
-    lock_retval = nlflash_lock(flash_id);
-    if (lock_retval < 0)
+    bytes = (const uint8_t *)words;
+    while (len > 0)
     {
-        return lock_retval;
+        if (*bytes++ != 0xFF)
+        {
+            return false;
+        }
+        len--;
     }
 
-    retval = g_flash_device_table[flash_id].read(from, len, retlen, buf, callback);
+    return true;
+}
 
-    lock_retval = nlflash_unlock(flash_id);
-    if ((lock_retval < 0) && (retval >= 0))
+// Blank check for drivers without their own: read each erase_size sector
+// and erase the ones that aren't blank.  Called with the lock held.
+static int erase_blank_check_sectors(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen,
+                                     size_t *skipped, nlloop_callback_fp callback)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    const size_t erase_size = table->get_info()->erase_size;
+    uint32_t buf[NLFLASH_BLANK_CHECK_BUFFER_SIZE / sizeof(uint32_t)];
+    int retval = 0;
+
+    *retlen = 0;
+    *skipped = 0;
+
+    while (*retlen < len)
     {
-        retval = lock_retval;
+        uint32_t sector = from + *retlen;
+        size_t offset = 0;
+        size_t sector_retlen;
+
+        while (offset < erase_size)
+        {
+            size_t chunk = MIN(sizeof(buf), erase_size - offset);
+
+            retval = table->read(sector + offset, chunk, &sector_retlen, (uint8_t *)buf, NULL);
+            if (retval < 0)
+            {
+                return retval;
+            }
+            if (!nlflash_buf_is_blank(buf, chunk))
+            {
+                break;
+            }
+            offset += chunk;
+        }
+
+        if (offset < erase_size)
+        {
+            retval = table->erase(sector, erase_size, &sector_retlen, callback);
+            if (retval < 0)
+            {
+                return retval;
+            }
+        }
+        else
+        {
+            (*skipped)++;
+        }
+        *retlen += erase_size;
     }
 
     return retval;
 }
 
-int nlflash_write(nlflash_id_t flash_id, uint32_t to, size_t len, size_t *retlen,
-                  const uint8_t *buf, nlloop_callback_fp callback)
+int nlflash_erase_blank_check(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen,
+                              size_t *skipped, nlloop_callback_fp callback)
 {
+    flash_stats_op_t op;
     int retval;
     int lock_retval;
 
-    // write is not optional
-    nlASSERT(g_flash_device_table[flash_id].write != NULL);
+    // erase is not optional
+    nlASSERT(g_flash_device_table[flash_id].erase != NULL);
+
+    // Start and end of the area to be erased must be on erase_size boundaries.
+    nlASSERT(erase_alignment_is_ok(flash_id, from, len));
+
+    lock_retval = nlflash_lock(flash_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+
+    stats_op_begin(flash_id, &op, true);
+    *retlen = 0;
+    // erase_blank_check is optional
+    if (g_flash_device_table[flash_id].erase_blank_check != NULL)
+    {
+        retval = g_flash_device_table[flash_id].erase_blank_check(from, len, retlen, skipped, callback);
+    }
+    else
+    {
+        retval = erase_blank_check_sectors(flash_id, from, len, retlen, skipped, callback);
+    }
+    stats_op_end(flash_id, &op, NLFLASH_STATS_ERASE, *retlen, retval);
+    nlflash_cache_invalidate(flash_id, from, len);
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+int nlflash_read(nlflash_id_t flash_id, uint32_t from, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback)
+{
+    flash_stats_op_t op;
+    int retval;
+    int lock_retval;
+
+    // read is not optional
+    nlASSERT(g_flash_device_table[flash_id].read != NULL);
+
+    // rather than wait for the lock behind a long program or erase, try
+    // to have the op suspended while we read
+    if (g_flash_device_table[flash_id].read_preempt != NULL)
+    {
+        retval = g_flash_device_table[flash_id].read_preempt(from, len, retlen, buf);
+        if (retval != -EAGAIN)
+        {
+            return retval;
+        }
+    }
+
+    lock_retval = nlflash_lock(flash_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+
+    *retlen = 0;
+    if (cache_covers(flash_id, from, len))
+    {
+        // the flash is only requested on a miss
+        stats_op_begin(flash_id, &op, false);
+        retval = cache_read(flash_id, from, len, retlen, buf);
+    }
+    else
+    {
+        stats_op_begin(flash_id, &op, true);
+        retval = g_flash_device_table[flash_id].read(from, len, retlen, buf, callback);
+    }
+    stats_op_end(flash_id, &op, NLFLASH_STATS_READ, *retlen, retval);
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+int nlflash_write(nlflash_id_t flash_id, uint32_t to, size_t len, size_t *retlen,
+                  const uint8_t *buf, nlloop_callback_fp callback)
+{
+    flash_stats_op_t op;
+    int retval;
+    int lock_retval;
+
+    // write is not optional
+    nlASSERT(g_flash_device_table[flash_id].write != NULL);
 
     lock_retval = nlflash_lock(flash_id);
     if (lock_retval < 0)
@@ -276,7 +939,639 @@ int nlflash_write(nlflash_id_t flash_id, uint32_t to, size_t len, size_t *retlen
 
     // No need to check alignment of area to be written; our write functions
     // either accept unaligned addresses or contain their own assertions.
+    stats_op_begin(flash_id, &op, true);
+    *retlen = 0;
     retval = g_flash_device_table[flash_id].write(to, len, retlen, buf, callback);
+    stats_op_end(flash_id, &op, NLFLASH_STATS_WRITE, *retlen, retval);
+    nlflash_cache_invalidate(flash_id, to, len);
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+static size_t iov_total(const nlflash_iovec_t *iov, unsigned iovcnt)
+{
+    size_t total = 0;
+    unsigned i;
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        total += iov[i].len;
+    }
+    return total;
+}
+
+// Read or write a buffer at a time, for flash without readv/writev, with
+// the flash kept powered between buffers.  Called with the lock held.
+static int iov_pieces(nlflash_id_t flash_id, bool write, uint32_t addr, const nlflash_iovec_t *iov, unsigned iovcnt,
+                      size_t *retlen)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    int retval = 0;
+    unsigned i;
+
+    *retlen = 0;
+
+    if (table->request != NULL)
+    {
+        retval = table->request();
+        if (retval < 0)
+        {
+            return retval;
+        }
+    }
+
+    for (i = 0; i < iovcnt; i++)
+    {
+        uint32_t piece_addr = addr + *retlen;
+        size_t piece_retlen = 0;
+
+        if (write)
+        {
+            retval = table->write(piece_addr, iov[i].len, &piece_retlen, iov[i].base, NULL);
+        }
+        else if (cache_covers(flash_id, piece_addr, iov[i].len))
+        {
+            retval = cache_read(flash_id, piece_addr, iov[i].len, &piece_retlen, iov[i].base);
+        }
+        else
+        {
+            retval = table->read(piece_addr, iov[i].len, &piece_retlen, iov[i].base, NULL);
+        }
+        *retlen += piece_retlen;
+        if (retval < 0)
+        {
+            break;
+        }
+    }
+
+    if (table->release != NULL)
+    {
+        table->release();
+    }
+
+    return retval;
+}
+
+int nlflash_readv(nlflash_id_t flash_id, uint32_t from, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    flash_stats_op_t op;
+    int retval = -ENOTSUP;
+    int lock_retval;
+
+    lock_retval = nlflash_lock(flash_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+
+    stats_op_begin(flash_id, &op, true);
+    *retlen = 0;
+    // reads the cache would take go a buffer at a time through it
+    if ((table->readv != NULL) && !cache_covers(flash_id, from, iov_total(iov, iovcnt)))
+    {
+        retval = table->readv(from, iov, iovcnt, retlen);
+    }
+    if (retval == -ENOTSUP)
+    {
+        retval = iov_pieces(flash_id, false, from, iov, iovcnt, retlen);
+    }
+    stats_op_end(flash_id, &op, NLFLASH_STATS_READ, *retlen, retval);
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+int nlflash_writev(nlflash_id_t flash_id, uint32_t to, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    flash_stats_op_t op;
+    int retval = -ENOTSUP;
+    int lock_retval;
+
+    lock_retval = nlflash_lock(flash_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+
+    stats_op_begin(flash_id, &op, true);
+    *retlen = 0;
+    if (table->writev != NULL)
+    {
+        retval = table->writev(to, iov, iovcnt, retlen);
+    }
+    if (retval == -ENOTSUP)
+    {
+        retval = iov_pieces(flash_id, true, to, iov, iovcnt, retlen);
+    }
+    stats_op_end(flash_id, &op, NLFLASH_STATS_WRITE, *retlen, retval);
+    nlflash_cache_invalidate(flash_id, to, iov_total(iov, iovcnt));
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+// Fill and write a buffer at a time, for flash without write_stream.
+static int write_stream_buffered(nlflash_id_t flash_id, uint32_t to, size_t len, size_t *retlen,
+                                 nlflash_write_producer_t producer, void *context)
+{
+    const nlflash_info_t *info = g_flash_device_table[flash_id].get_info();
+    uint8_t buf[NLFLASH_WRITE_STREAM_BUFFER_SIZE];
+    int retval = 0;
+
+    *retlen = 0;
+
+    while (*retlen < len)
+    {
+        uint32_t addr = to + *retlen;
+        size_t requested = MIN(sizeof(buf), len - *retlen);
+        size_t written = 0;
+        int filled;
+
+        // don't let a buffer straddle a page
+        if (info->write_size > 1)
+        {
+            requested = MIN(requested, info->write_size - (addr % info->write_size));
+        }
+
+        filled = producer(buf, requested, context);
+        if (filled <= 0)
+        {
+            retval = filled;
+            break;
+        }
+        if ((size_t)filled > requested)
+        {
+            return -EINVAL;
+        }
+
+        retval = g_flash_device_table[flash_id].write(addr, filled, &written, buf, NULL);
+        *retlen += written;
+        if (retval < 0)
+        {
+            return retval;
+        }
+    }
+
+    return retval;
+}
+
+int nlflash_write_stream(nlflash_id_t flash_id, uint32_t to, size_t len, size_t *retlen,
+                         nlflash_write_producer_t producer, void *context)
+{
+    flash_stats_op_t op;
+    int retval;
+    int lock_retval;
+
+    // write is not optional
+    nlASSERT(g_flash_device_table[flash_id].write != NULL);
+    nlASSERT(producer != NULL);
+
+    lock_retval = nlflash_lock(flash_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+
+    stats_op_begin(flash_id, &op, true);
+    *retlen = 0;
+    retval = -ENOTSUP;
+    if (g_flash_device_table[flash_id].write_stream != NULL)
+    {
+        retval = g_flash_device_table[flash_id].write_stream(to, len, retlen, producer, context);
+    }
+    if (retval == -ENOTSUP)
+    {
+        retval = write_stream_buffered(flash_id, to, len, retlen, producer, context);
+    }
+    stats_op_end(flash_id, &op, NLFLASH_STATS_WRITE, *retlen, retval);
+    nlflash_cache_invalidate(flash_id, to, len);
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+typedef struct
+{
+    const nlflash_func_table_t *src_table;
+    uint32_t src;
+} copy_context_t;
+
+static int copy_producer(uint8_t *buf, size_t len, void *context)
+{
+    copy_context_t *copy = (copy_context_t *)context;
+    size_t retlen = 0;
+    int retval;
+
+    retval = copy->src_table->read(copy->src, len, &retlen, buf, NULL);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    // only what was read is programmed; the next fill carries on from there
+    copy->src += retlen;
+    return retlen;
+}
+
+// Copy [src, src + len) to dst with the lock held on both flash.  Reads of
+// src are produced into dst's write stream, so they overlap dst's programs
+// when dst streams writes and src is different flash.
+static int copy_range(nlflash_id_t src_id, uint32_t src, nlflash_id_t dst_id, uint32_t dst, size_t len,
+                      size_t *retlen)
+{
+    const nlflash_func_table_t *dst_table = &g_flash_device_table[dst_id];
+    copy_context_t copy = { &g_flash_device_table[src_id], src };
+    int retval = -ENOTSUP;
+
+    *retlen = 0;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    // the producer can't read flash that is busy programming
+    if ((src_id != dst_id) && (dst_table->write_stream != NULL))
+    {
+        retval = dst_table->write_stream(dst, len, retlen, copy_producer, &copy);
+    }
+    if (retval == -ENOTSUP)
+    {
+        retval = write_stream_buffered(dst_id, dst, len, retlen, copy_producer, &copy);
+    }
+
+    return retval;
+}
+
+// Returns 1 if [src, src + len) matches [dst, dst + len), 0 if not.
+static int copy_range_matches(nlflash_id_t src_id, uint32_t src, nlflash_id_t dst_id, uint32_t dst, size_t len)
+{
+    uint32_t src_buf[NLFLASH_COPY_BUFFER_SIZE / sizeof(uint32_t)];
+    uint32_t dst_buf[NLFLASH_COPY_BUFFER_SIZE / sizeof(uint32_t)];
+    size_t offset = 0;
+    size_t retlen;
+    int retval;
+
+    while (offset < len)
+    {
+        size_t chunk = MIN(sizeof(src_buf), len - offset);
+
+        retval = g_flash_device_table[src_id].read(src + offset, chunk, &retlen, (uint8_t *)src_buf, NULL);
+        if (retval < 0)
+        {
+            return retval;
+        }
+        retval = g_flash_device_table[dst_id].read(dst + offset, chunk, &retlen, (uint8_t *)dst_buf, NULL);
+        if (retval < 0)
+        {
+            return retval;
+        }
+        if (memcmp(src_buf, dst_buf, chunk) != 0)
+        {
+            return 0;
+        }
+        offset += chunk;
+    }
+
+    return 1;
+}
+
+static int copy_locked(nlflash_id_t src_id, uint32_t src, nlflash_id_t dst_id, uint32_t dst, size_t len,
+                       size_t *retlen, bool skip_matching)
+{
+    const nlflash_info_t *dst_info = g_flash_device_table[dst_id].get_info();
+    size_t page = MAX(dst_info->write_size, 1);
+    size_t run_start = 0;
+    size_t offset = 0;
+    size_t run_retlen;
+    int retval;
+
+    *retlen = 0;
+
+    if (!skip_matching)
+    {
+        return copy_range(src_id, src, dst_id, dst, len, retlen);
+    }
+
+    // compare at least a buffer at a time on flash with small pages
+    if (page < NLFLASH_COPY_BUFFER_SIZE)
+    {
+        page = ROUNDDOWN(NLFLASH_COPY_BUFFER_SIZE, page);
+    }
+
+    // Copy runs of destination pages that differ from the source, skipping
+    // the pages in between that already match.
+    while (offset < len)
+    {
+        size_t chunk = MIN(page - ((dst + offset) % page), len - offset);
+
+        retval = copy_range_matches(src_id, src + offset, dst_id, dst + offset, chunk);
+        if (retval < 0)
+        {
+            return retval;
+        }
+        if (retval > 0)
+        {
+            retval = copy_range(src_id, src + run_start, dst_id, dst + run_start, offset - run_start, &run_retlen);
+            *retlen += run_retlen;
+            if (retval < 0)
+            {
+                return retval;
+            }
+            *retlen += chunk;
+            run_start = offset + chunk;
+        }
+        offset += chunk;
+    }
+
+    retval = copy_range(src_id, src + run_start, dst_id, dst + run_start, len - run_start, &run_retlen);
+    *retlen += run_retlen;
+
+    return retval;
+}
+
+static bool same_lock(nlflash_id_t a, nlflash_id_t b)
+{
+    return (a == b) ||
+           ((s_flash_ctxs[a].lock == s_flash_ctxs[b].lock) &&
+            (s_flash_ctxs[a].lock_ctx == s_flash_ctxs[b].lock_ctx));
+}
+
+int nlflash_copy(nlflash_id_t src_id, uint32_t src, nlflash_id_t dst_id, uint32_t dst, size_t len,
+                 size_t *retlen, bool skip_matching)
+{
+    // lock in id order so two copies in opposite directions can't deadlock
+    nlflash_id_t first_id = MIN(src_id, dst_id);
+    nlflash_id_t second_id = MAX(src_id, dst_id);
+    bool lock_second = !same_lock(first_id, second_id);
+    int retval;
+    int lock_retval;
+
+    // read and write are not optional
+    nlASSERT(g_flash_device_table[src_id].read != NULL);
+    nlASSERT(g_flash_device_table[dst_id].write != NULL);
+
+    *retlen = 0;
+
+    if ((src_id == dst_id) && (src < dst + len) && (dst < src + len))
+    {
+        return -EINVAL;
+    }
+
+    lock_retval = nlflash_lock(first_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+    if (lock_second)
+    {
+        lock_retval = nlflash_lock(second_id);
+        if (lock_retval < 0)
+        {
+            nlflash_unlock(first_id);
+            return lock_retval;
+        }
+    }
+
+    // keep both powered up for the whole copy
+    retval = 0;
+    if (g_flash_device_table[src_id].request != NULL)
+    {
+        retval = g_flash_device_table[src_id].request();
+    }
+    if ((retval >= 0) && (dst_id != src_id) && (g_flash_device_table[dst_id].request != NULL))
+    {
+        retval = g_flash_device_table[dst_id].request();
+        if ((retval < 0) && (g_flash_device_table[src_id].release != NULL))
+        {
+            g_flash_device_table[src_id].release();
+        }
+    }
+
+    if (retval >= 0)
+    {
+        retval = copy_locked(src_id, src, dst_id, dst, len, retlen, skip_matching);
+        nlflash_cache_invalidate(dst_id, dst, len);
+
+        if ((dst_id != src_id) && (g_flash_device_table[dst_id].release != NULL))
+        {
+            g_flash_device_table[dst_id].release();
+        }
+        if (g_flash_device_table[src_id].release != NULL)
+        {
+            g_flash_device_table[src_id].release();
+        }
+    }
+
+    if (lock_second)
+    {
+        lock_retval = nlflash_unlock(second_id);
+        if ((lock_retval < 0) && (retval >= 0))
+        {
+            retval = lock_retval;
+        }
+    }
+    lock_retval = nlflash_unlock(first_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+int nlflash_read_session_begin(nlflash_id_t flash_id, uint32_t from)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    int retval;
+
+    retval = nlflash_lock(flash_id);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    retval = -ENOTSUP;
+    if (table->read_session_begin != NULL)
+    {
+        retval = table->read_session_begin(from);
+    }
+    if (retval == -ENOTSUP)
+    {
+        // read each piece normally, but keep the flash powered up
+        retval = 0;
+        if (table->request != NULL)
+        {
+            retval = table->request();
+        }
+        s_flash_ctxs[flash_id].session_addr = from;
+    }
+
+    // The lock is only kept on success, until nlflash_read_session_end().
+    if (retval < 0)
+    {
+        nlflash_unlock(flash_id);
+    }
+
+    return retval;
+}
+
+int nlflash_read_session_read(nlflash_id_t flash_id, size_t len, size_t *retlen, uint8_t *buf)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    int retval = -ENOTSUP;
+
+    if (table->read_session_read != NULL)
+    {
+        retval = table->read_session_read(len, retlen, buf);
+    }
+    if (retval == -ENOTSUP)
+    {
+        retval = table->read(s_flash_ctxs[flash_id].session_addr, len, retlen, buf, NULL);
+        s_flash_ctxs[flash_id].session_addr += *retlen;
+    }
+
+    return retval;
+}
+
+int nlflash_read_session_end(nlflash_id_t flash_id)
+{
+    const nlflash_func_table_t *table = &g_flash_device_table[flash_id];
+    int retval = -ENOTSUP;
+    int lock_retval;
+
+    if (table->read_session_end != NULL)
+    {
+        retval = table->read_session_end();
+    }
+    if (retval == -ENOTSUP)
+    {
+        retval = 0;
+        if (table->release != NULL)
+        {
+            retval = table->release();
+        }
+    }
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+int nlflash_read_async(nlflash_id_t flash_id, uint32_t from, size_t len, uint8_t *buf,
+                       nlflash_async_handler_t callback, void *context)
+{
+    int retval;
+
+    // read is not optional
+    nlASSERT(g_flash_device_table[flash_id].read != NULL);
+    nlASSERT(callback != NULL);
+
+    retval = nlflash_lock(flash_id);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    // read_async is optional, fall back to a synchronous read that
+    // completes before we return.
+    retval = -ENOTSUP;
+    if (g_flash_device_table[flash_id].read_async != NULL)
+    {
+        retval = g_flash_device_table[flash_id].read_async(from, len, buf, callback, context);
+    }
+    s_flash_ctxs[flash_id].async_in_driver = (retval != -ENOTSUP);
+    if (retval == -ENOTSUP)
+    {
+        size_t retlen;
+
+        retval = g_flash_device_table[flash_id].read(from, len, &retlen, buf, NULL);
+        if (retval >= 0)
+        {
+            s_flash_ctxs[flash_id].async_result = retval;
+            callback(retval, context);
+        }
+    }
+
+    // The lock is only kept on success, until nlflash_read_async_finish().
+    if (retval < 0)
+    {
+        nlflash_unlock(flash_id);
+    }
+
+    return retval;
+}
+
+int nlflash_read_async_finish(nlflash_id_t flash_id)
+{
+    int retval;
+    int lock_retval;
+
+    if (s_flash_ctxs[flash_id].async_in_driver)
+    {
+        // read_async_finish is not optional if read_async is provided
+        nlASSERT(g_flash_device_table[flash_id].read_async_finish != NULL);
+        retval = g_flash_device_table[flash_id].read_async_finish();
+    }
+    else
+    {
+        retval = s_flash_ctxs[flash_id].async_result;
+    }
+
+    lock_retval = nlflash_unlock(flash_id);
+    if ((lock_retval < 0) && (retval >= 0))
+    {
+        retval = lock_retval;
+    }
+
+    return retval;
+}
+
+int nlflash_get_erase_time(nlflash_id_t flash_id, uint32_t from, size_t len, uint32_t *usec)
+{
+    int retval;
+    int lock_retval;
+
+    // get_erase_time is optional
+    if (g_flash_device_table[flash_id].get_erase_time == NULL)
+    {
+        return -ENOTSUP;
+    }
+
+    lock_retval = nlflash_lock(flash_id);
+    if (lock_retval < 0)
+    {
+        return lock_retval;
+    }
+
+    retval = g_flash_device_table[flash_id].get_erase_time(from, len, usec);
 
     lock_retval = nlflash_unlock(flash_id);
     if ((lock_retval < 0) && (retval >= 0))
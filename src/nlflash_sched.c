@@ -0,0 +1,315 @@
+/*
+ *
+ *    Copyright (c) 2018 Nest Labs, Inc.
+ *    All rights reserved.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ *    Description:
+ *      This file implements a flash service task that does queued
+ *      flash requests a slice at a time, in priority order.  Each
+ *      slice goes through the nlflash.c API, so the flash can still
+ *      be used directly by other tasks.
+ *
+ */
+
+#include <nlassert.h>
+#include <errno.h>
+#include <nlplatform.h>
+
+// the scheduler needs its task
+#ifndef NL_NO_RTOS
+
+#include <nlplatform/nlflash.h>
+#include <nlplatform/nlflash_sched.h>
+#include <nlutilities.h>
+
+#include <FreeRTOS.h>
+#include <task.h>
+
+#ifndef NLFLASH_SCHED_TASK_PRIORITY
+#define NLFLASH_SCHED_TASK_PRIORITY (tskIDLE_PRIORITY + 1)
+#endif
+
+// in words
+#ifndef NLFLASH_SCHED_STACK_SIZE
+#define NLFLASH_SCHED_STACK_SIZE 256
+#endif
+
+// most bytes read or written per slice
+#ifndef NLFLASH_SCHED_READ_SLICE_SIZE
+#define NLFLASH_SCHED_READ_SLICE_SIZE 4096
+#endif
+#ifndef NLFLASH_SCHED_WRITE_SLICE_SIZE
+#define NLFLASH_SCHED_WRITE_SLICE_SIZE 256
+#endif
+
+// erase_size blocks erased per slice
+#ifndef NLFLASH_SCHED_ERASE_SLICE_BLOCKS
+#define NLFLASH_SCHED_ERASE_SLICE_BLOCKS 1
+#endif
+
+static StaticTask_t s_sched_tcb;
+static StackType_t s_sched_stack[NLFLASH_SCHED_STACK_SIZE];
+static TaskHandle_t s_sched_task;
+
+// queued requests, in no particular order, and the one being worked on.
+// only changed with interrupts disabled.
+static nlflash_sched_request_t *s_queue;
+static nlflash_sched_request_t *s_current;
+static uint32_t s_seq;
+
+// Returns true if a should go before b.
+static bool sched_before(const nlflash_sched_request_t *a, const nlflash_sched_request_t *b)
+{
+    TickType_t now;
+
+    if (a->priority != b->priority)
+    {
+        return (a->priority > b->priority);
+    }
+
+    if (a->deadline != b->deadline)
+    {
+        if ((a->deadline == 0) || (b->deadline == 0))
+        {
+            return (b->deadline == 0);
+        }
+        // compare time left, so the tick count can wrap
+        now = xTaskGetTickCount();
+        return ((int32_t)(a->deadline - now) < (int32_t)(b->deadline - now));
+    }
+
+    if ((a->op == NLFLASH_SCHED_READ) != (b->op == NLFLASH_SCHED_READ))
+    {
+        return (a->op == NLFLASH_SCHED_READ);
+    }
+
+    return ((int32_t)(a->seq - b->seq) < 0);
+}
+
+// Take the request that goes first off the queue and make it current.
+static nlflash_sched_request_t *sched_next(void)
+{
+    nlflash_sched_request_t **best = NULL;
+    nlflash_sched_request_t **link;
+    nlflash_sched_request_t *request = NULL;
+
+    nlplatform_interrupt_disable();
+
+    for (link = &s_queue; *link != NULL; link = &(*link)->next)
+    {
+        if ((best == NULL) || sched_before(*link, *best))
+        {
+            best = link;
+        }
+    }
+    if (best != NULL)
+    {
+        request = *best;
+        *best = request->next;
+        request->next = NULL;
+    }
+    s_current = request;
+
+    nlplatform_interrupt_enable();
+
+    return request;
+}
+
+static void sched_requeue(nlflash_sched_request_t *request)
+{
+    nlplatform_interrupt_disable();
+    request->next = s_queue;
+    s_queue = request;
+    s_current = NULL;
+    nlplatform_interrupt_enable();
+}
+
+static void sched_complete(nlflash_sched_request_t *request, int result)
+{
+    TaskHandle_t task = request->task;
+    nlflash_sched_handler_t callback = request->callback;
+
+    request->result = result;
+
+    nlplatform_interrupt_disable();
+    s_current = NULL;
+    request->busy = false;
+    nlplatform_interrupt_enable();
+
+    // the request may be reused as soon as it's signalled
+    if (callback != NULL)
+    {
+        callback(request);
+    }
+    if (task != NULL)
+    {
+        xTaskNotifyGive(task);
+    }
+}
+
+// Do the next slice of request.  Returns < 0 on error.
+static int sched_run_slice(nlflash_sched_request_t *request)
+{
+    uint32_t addr = request->addr + request->done;
+    size_t left = request->len - request->done;
+    size_t retlen = 0;
+    int retval;
+
+    switch (request->op)
+    {
+        case NLFLASH_SCHED_READ:
+            retval = nlflash_read(request->flash_id, addr, MIN(left, NLFLASH_SCHED_READ_SLICE_SIZE), &retlen,
+                                  (uint8_t *)request->buf + request->done, NULL);
+            break;
+
+        case NLFLASH_SCHED_WRITE:
+            // end slices on multiples of the slice size, so page sized
+            // slices are whole pages
+            retval = nlflash_write(request->flash_id, addr,
+                                   MIN(left, NLFLASH_SCHED_WRITE_SLICE_SIZE - (addr % NLFLASH_SCHED_WRITE_SLICE_SIZE)),
+                                   &retlen, (const uint8_t *)request->buf + request->done, NULL);
+            break;
+
+        default:
+        {
+            const nlflash_info_t *info = nlflash_get_info(request->flash_id);
+
+            retval = nlflash_erase(request->flash_id, addr,
+                                   MIN(left, info->erase_size * NLFLASH_SCHED_ERASE_SLICE_BLOCKS), &retlen, NULL);
+            break;
+        }
+    }
+
+    request->done += retlen;
+    return retval;
+}
+
+static void sched_task(void *arg)
+{
+    while (true)
+    {
+        nlflash_sched_request_t *request = sched_next();
+        int retval;
+
+        if (request == NULL)
+        {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+            continue;
+        }
+
+        retval = sched_run_slice(request);
+        if ((retval < 0) || (request->done >= request->len))
+        {
+            sched_complete(request, MIN(retval, 0));
+        }
+        else
+        {
+            sched_requeue(request);
+        }
+    }
+}
+
+void nlflash_sched_init(void)
+{
+    s_sched_task = xTaskCreateStatic(sched_task, "flash", NLFLASH_SCHED_STACK_SIZE, NULL,
+                                     NLFLASH_SCHED_TASK_PRIORITY, s_sched_stack, &s_sched_tcb);
+    nlASSERT(s_sched_task != NULL);
+}
+
+int nlflash_sched_submit(nlflash_sched_request_t *request)
+{
+    // nlflash_sched_init() must have been called
+    nlASSERT(s_sched_task != NULL);
+
+    if ((request->op > NLFLASH_SCHED_ERASE) || (request->len == 0) ||
+        ((request->op != NLFLASH_SCHED_ERASE) && (request->buf == NULL)))
+    {
+        return -EINVAL;
+    }
+
+    if (request->op == NLFLASH_SCHED_ERASE)
+    {
+        const nlflash_info_t *info = nlflash_get_info(request->flash_id);
+
+        if ((info == NULL) || (request->addr % info->erase_size != 0) || (request->len % info->erase_size != 0))
+        {
+            return -EINVAL;
+        }
+    }
+
+    nlplatform_interrupt_disable();
+    if (request->busy)
+    {
+        nlplatform_interrupt_enable();
+        return -EBUSY;
+    }
+    request->busy = true;
+    request->done = 0;
+    request->result = 0;
+    request->seq = s_seq++;
+    request->next = s_queue;
+    s_queue = request;
+    nlplatform_interrupt_enable();
+
+    xTaskNotifyGive(s_sched_task);
+    return 0;
+}
+
+int nlflash_sched_cancel(nlflash_sched_request_t *request)
+{
+    nlflash_sched_request_t **link;
+    int retval = -ENOENT;
+
+    nlplatform_interrupt_disable();
+    // a request is requeued between slices, so it's only not started if
+    // nothing of it is done yet
+    if ((request == s_current) || (request->busy && (request->done > 0)))
+    {
+        retval = -EBUSY;
+    }
+    else
+    {
+        for (link = &s_queue; *link != NULL; link = &(*link)->next)
+        {
+            if (*link == request)
+            {
+                *link = request->next;
+                request->next = NULL;
+                request->busy = false;
+                retval = 0;
+                break;
+            }
+        }
+    }
+    nlplatform_interrupt_enable();
+
+    return retval;
+}
+
+int nlflash_sched_wait(nlflash_sched_request_t *request)
+{
+    nlASSERT(request->task == xTaskGetCurrentTaskHandle());
+
+    // other notifications to this task may wake us early
+    while (request->busy)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    return request->result;
+}
+
+#endif /* !defined(NL_NO_RTOS) */
@@ -20,13 +20,17 @@
  *    Description:
  *      This file implements an API for accessing flash through a
  *      SPI interface.  It supports FLASH chips like N25Q and
- *      MX25U1635 that have no intermediate SRAM buffers.  With
- *      some changes, it could be made to optionally support
- *      FLASH chips with intermediate SRAM buffers.
+ *      MX25U1635 that have no intermediate SRAM buffers, and
+ *      with FLASH_SPI_USE_SRAM_BUFFERS can program chips like the
+ *      AT45DB041E through their two SRAM buffers.
  *
  *      The APIs in this file are called by the nlflash.c layer,
  *      which provides mutex (recursive) locking, so no locking
  *      is required here.
+ *
+ *      Up to FLASH_SPI_NUM_DEVICES chips can be driven, each on its
+ *      own spi slave, described by its own nlflash_spi_chip_t and
+ *      registered under its own nlflash_id_t.
  */
 
 #include <errno.h>
@@ -40,10 +44,133 @@
 #include <nlplatform/nlgpio.h>
 #include <nlutilities.h>
 
+#ifdef FLASH_SPI_USE_SUSPEND
+#ifdef NL_NO_RTOS
+#error "FLASH_SPI_USE_SUSPEND requires an RTOS"
+#endif
+#ifndef CMD_SUSPEND
+#error "FLASH_SPI_USE_SUSPEND requires a chip with program/erase suspend"
+#endif
+#include <FreeRTOS.h>
+#include <task.h>
+#endif
+
+// keep the chip in standby for this long after the last release before
+// powering it down, so bursts of requests don't each pay the wake up
+// and chip id checks.  0 powers down on every release.
+#ifndef FLASH_SPI_POWERDOWN_IDLE_MSEC
+#define FLASH_SPI_POWERDOWN_IDLE_MSEC 0
+#endif
+
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 0)
+#error "FLASH_SPI_POWERDOWN_IDLE_MSEC requires FLASH_SPI_SPLIT_TRANSACTIONS"
+#endif
+#ifdef NL_NO_RTOS
+#error "FLASH_SPI_POWERDOWN_IDLE_MSEC requires an RTOS"
+#endif
+#include <FreeRTOS.h>
+#include <timers.h>
+#include <nlplatform/nlswtimer.h>
+#endif
+
 #ifndef FLASH_SPI_SPLIT_TRANSACTIONS
 #error "Must define FLASH_SPI_SPLIT_TRANSACTIONS to 0 or 1"
 #endif
 
+// wait for program and erase on the chip's ready/busy output rather than
+// polling the status register, leaving the spi bus free and waking up as
+// soon as the op is done.  the product defines FLASH_SPI_READY_GPIO(n) as
+// the gpio wired to device n's ready/busy output.
+#ifdef FLASH_SPI_USE_READY_GPIO
+#ifndef FLASH_SPI_READY_GPIO
+#error "FLASH_SPI_USE_READY_GPIO requires FLASH_SPI_READY_GPIO(n)"
+#endif
+#ifdef FLASH_SPI_USE_SUSPEND
+// a suspended op would look done
+#error "FLASH_SPI_USE_READY_GPIO can't be used with FLASH_SPI_USE_SUSPEND"
+#endif
+// pin level when the chip is ready, and the irq for the change to it
+#ifndef FLASH_SPI_READY_GPIO_VALUE
+#define FLASH_SPI_READY_GPIO_VALUE 1
+#endif
+#ifndef FLASH_SPI_READY_GPIO_IRQ_FLAGS
+#define FLASH_SPI_READY_GPIO_IRQ_FLAGS IRQF_TRIGGER_RISING
+#endif
+#ifdef NL_NO_RTOS
+// without an RTOS, poll the pin this often
+#ifndef FLASH_SPI_READY_POLL_USEC
+#define FLASH_SPI_READY_POLL_USEC 50
+#endif
+#else
+#include <FreeRTOS.h>
+#include <task.h>
+#endif
+#endif /* FLASH_SPI_USE_READY_GPIO */
+
+#ifdef FLASH_SPI_USE_POWER_MODE
+// chips like the MX25R run in ultra low power mode unless the L/H switch in
+// their volatile configuration register selects high performance mode
+#if !defined(CMD_RDCR) || !defined(M_CR2_HP_MODE)
+#error "FLASH_SPI_USE_POWER_MODE requires a chip with an L/H switch"
+#endif
+#include <nlplatform/nltime.h>
+// in auto mode, switch to high performance once this many bytes have been
+// read, programmed or erased in the current or previous window
+#ifndef FLASH_SPI_HP_MODE_MIN_BYTES
+#define FLASH_SPI_HP_MODE_MIN_BYTES 4096
+#endif
+#ifndef FLASH_SPI_HP_MODE_WINDOW_MSEC
+#define FLASH_SPI_HP_MODE_WINDOW_MSEC 1000
+#endif
+#endif /* FLASH_SPI_USE_POWER_MODE */
+
+#ifdef FLASH_SPI_USE_CLOCK_CALIBRATION
+// at init, raise the spi clock from the slave's max_freq_hz for as long as
+// a reserved region holding a known pattern keeps reading back correctly,
+// or lower it until it does
+#ifndef FLASH_SPI_CLOCK_CAL_ADDR
+#error "FLASH_SPI_USE_CLOCK_CALIBRATION requires FLASH_SPI_CLOCK_CAL_ADDR"
+#endif
+#include <nlplatform/nlcrc.h>
+#ifndef FLASH_SPI_CLOCK_CAL_SIZE
+#define FLASH_SPI_CLOCK_CAL_SIZE FLASH_SPI_WRITE_SIZE
+#endif
+#ifndef FLASH_SPI_CLOCK_CAL_MAX_HZ
+#define FLASH_SPI_CLOCK_CAL_MAX_HZ FLASH_SPI_FAST_READ_FREQ_HZ
+#endif
+#ifndef FLASH_SPI_CLOCK_CAL_STEP_HZ
+#define FLASH_SPI_CLOCK_CAL_STEP_HZ 4000000
+#endif
+// slowest rate tried, which the region is also checked and programmed at
+#ifndef FLASH_SPI_CLOCK_CAL_MIN_HZ
+#define FLASH_SPI_CLOCK_CAL_MIN_HZ FLASH_SPI_CLOCK_CAL_STEP_HZ
+#endif
+// steps to back off from the fastest rate that passed
+#ifndef FLASH_SPI_CLOCK_CAL_MARGIN_STEPS
+#define FLASH_SPI_CLOCK_CAL_MARGIN_STEPS 1
+#endif
+// reads of the region that must all pass at a rate
+#ifndef FLASH_SPI_CLOCK_CAL_PASSES
+#define FLASH_SPI_CLOCK_CAL_PASSES 4
+#endif
+#ifndef FLASH_SPI_CLOCK_CAL_BUFFER_SIZE
+#define FLASH_SPI_CLOCK_CAL_BUFFER_SIZE 64
+#endif
+#endif /* FLASH_SPI_USE_CLOCK_CALIBRATION */
+
+#ifndef FLASH_SPI_NUM_DEVICES
+#define FLASH_SPI_NUM_DEVICES 1
+#endif
+
+#if defined(FLASH_SPI_USE_SRAM_BUFFERS) && !defined(CMD_BUF1_WRITE)
+#error "FLASH_SPI_USE_SRAM_BUFFERS requires a chip with SRAM buffers"
+#endif
+
+#if FLASH_SPI_NUM_DEVICES > 4
+#error "FLASH_SPI_NUM_DEVICES must be at most 4"
+#endif
+
 #ifndef FLASH_SPI_MAX_CHIP_ID_CHECK_COUNT
 #define FLASH_SPI_MAX_CHIP_ID_CHECK_COUNT 3
 #endif
@@ -56,113 +183,584 @@
 #define FLASH_SPI_NUMBER_REQUEST_ATTEMPTS 3
 #endif
 
-typedef struct nlflash_spi_device_s {
+#if FLASH_SPI_HZ > FLASH_SPI_READ_FREQ_HZ
+// use fast read if the operating frequecy of spi is faster than the regular speed of the FLASH chip
+#define FLASH_SPI_READ_CMD          CMD_FAST_READ
+#define FLASH_SPI_READ_DUMMY_BYTES  FLASH_SPI_FAST_READ_DUMMY_CYCLES
+#else
+#define FLASH_SPI_READ_CMD          CMD_READ
+#define FLASH_SPI_READ_DUMMY_BYTES  FLASH_SPI_READ_DUMMY_CYCLES
+#endif
+
+// size of a cmd byte followed by a 3 byte address
+#define FLASH_SPI_CMD_ADDR_SIZE     4
+
+// most dummy bytes any read command needs
+#define FLASH_SPI_MAX_DUMMY_BYTES   4
+
+// read modes a chip header can select with FLASH_SPI_READ_MODE
+#define FLASH_SPI_READ_MODE_SINGLE          0
+#define FLASH_SPI_READ_MODE_DUAL_OUTPUT     1
+#define FLASH_SPI_READ_MODE_QUAD_OUTPUT     2
+#define FLASH_SPI_READ_MODE_QUAD_IO         3
+
+#ifndef FLASH_SPI_READ_MODE
+#define FLASH_SPI_READ_MODE FLASH_SPI_READ_MODE_SINGLE
+#endif
+
+#if (FLASH_SPI_READ_MODE != FLASH_SPI_READ_MODE_SINGLE) || defined(FLASH_SPI_USE_QUAD_PP)
+#define FLASH_SPI_MULTI_LINE 1
+#else
+#define FLASH_SPI_MULTI_LINE 0
+#endif
+
+#if (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_QUAD_OUTPUT) || \
+    (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_QUAD_IO) || defined(FLASH_SPI_USE_QUAD_PP)
+#define FLASH_SPI_NEEDS_QE 1
+#else
+#define FLASH_SPI_NEEDS_QE 0
+#endif
+
+#ifdef FLASH_SPI_USE_ADAPTIVE_BUSY_WAIT
+// first status poll after the expected completion time, doubled on each
+// miss up to the op's *_DELAY_MSEC
+#ifndef FLASH_SPI_BUSY_POLL_USEC
+#define FLASH_SPI_BUSY_POLL_USEC 50
+#endif
+
+// wake up 1/(2^FLASH_SPI_BUSY_EARLY_SHIFT) of the estimate early
+#ifndef FLASH_SPI_BUSY_EARLY_SHIFT
+#define FLASH_SPI_BUSY_EARLY_SHIFT 3
+#endif
+
+// each new measurement moves the estimate 1/(2^FLASH_SPI_BUSY_AVERAGE_SHIFT)
+// of the way towards it
+#ifndef FLASH_SPI_BUSY_AVERAGE_SHIFT
+#define FLASH_SPI_BUSY_AVERAGE_SHIFT 2
+#endif
+
+#endif /* FLASH_SPI_USE_ADAPTIVE_BUSY_WAIT */
+
+#ifdef FLASH_SPI_USE_SFDP
+#if (FLASH_SPI_USE_PAGE_OFFSET_ADDRESSING == 1)
+#error "FLASH_SPI_USE_SFDP requires binary addressing"
+#endif
+// JEDEC JESD216 read SFDP cmd, with 8 dummy clocks
+#ifndef CMD_RDSFDP
+#define CMD_RDSFDP 0x5A
+#endif
+#define SFDP_DUMMY_BYTES        1
+#define SFDP_SIGNATURE          0x50444653 // "SFDP"
+#define SFDP_PARAM_HEADER_ADDR  0x08
+#define SFDP_BFPT_ID_LSB        0x00
+#define SFDP_BFPT_ID_MSB        0xFF
+// dwords of the basic flash parameter table that we use (JESD216B)
+#define SFDP_BFPT_NUM_DWORDS    11
+#endif
+
+// largest write_size and fast_erase_size / erase_size of any device's part
+#ifndef FLASH_SPI_MAX_PAGE_SIZE
+#define FLASH_SPI_MAX_PAGE_SIZE FLASH_SPI_WRITE_SIZE
+#endif
+#ifndef FLASH_SPI_MAX_SECTORS_PER_BLOCK
+#define FLASH_SPI_MAX_SECTORS_PER_BLOCK (FLASH_SPI_FAST_ERASE_SIZE / FLASH_SPI_ERASE_SIZE)
+#endif
+
+// most buffers sent in one command by nlflash_spi_readv()/_writev()
+#ifndef FLASH_SPI_MAX_IOVECS
+#define FLASH_SPI_MAX_IOVECS 4
+#endif
+
 #ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
-    uint8_t partial_page[FLASH_SPI_MAX_PAGE_SIZE];
-    uint32_t partial_page_index;
-    uint32_t write_loc;
+// pages that partial writes are combined in before being programmed, so
+// writers interleaving small writes to different pages (e.g. a log and an
+// OTA image) don't flush each other's partial pages.  the least recently
+// written page is programmed when another one is needed.
+#ifndef FLASH_SPI_NUM_PARTIAL_PAGE_BUFFERS
+#define FLASH_SPI_NUM_PARTIAL_PAGE_BUFFERS 2
 #endif
-    uint8_t enable_ref;
-} nlflash_spi_device_t;
+#endif
+
+#ifdef FLASH_SPI_USE_WRITE_VERIFY
+// bytes read back at a time when verifying a programmed page
+#ifndef FLASH_SPI_VERIFY_BUFFER_SIZE
+#define FLASH_SPI_VERIFY_BUFFER_SIZE 64
+#endif
+#endif
+
+// bytes read at a time when checking whether sectors are blank
+#ifndef FLASH_SPI_BLANK_CHECK_BUFFER_SIZE
+#define FLASH_SPI_BLANK_CHECK_BUFFER_SIZE 128
+#endif
+
+#ifdef FLASH_SPI_USE_SUSPEND
+// how often a task waiting on a program or erase checks for reads to
+// serve.  must be longer than the chip's minimum time from resume to the
+// next suspend, or a stream of reads can keep the op from completing.
+#ifndef FLASH_SPI_SUSPEND_POLL_MSEC
+#define FLASH_SPI_SUSPEND_POLL_MSEC 1
+#endif
+
+// only reads from tasks at or above this priority preempt a program or erase
+#ifndef FLASH_SPI_SUSPEND_MIN_PRIORITY
+#define FLASH_SPI_SUSPEND_MIN_PRIORITY 0
+#endif
+#endif /* FLASH_SPI_USE_SUSPEND */
+
+// chips that don't list typical times fall back to the fixed poll delay
+#ifndef PP_TYP_USEC
+#define PP_TYP_USEC (PP_DELAY_MSEC * 1000)
+#endif
+#ifndef BE_TYP_USEC
+#define BE_TYP_USEC (BE_DELAY_MSEC * 1000)
+#endif
+#ifndef SE_TYP_USEC
+#define SE_TYP_USEC (SE_DELAY_MSEC * 1000)
+#endif
+#ifndef SSE_TYP_USEC
+#define SSE_TYP_USEC (SSE_DELAY_MSEC * 1000)
+#endif
+#if !defined(WRSR_TYP_USEC) && defined(WRSR_DELAY_MSEC)
+#define WRSR_TYP_USEC (WRSR_DELAY_MSEC * 1000)
+#elif !defined(WRSR_TYP_USEC)
+#define WRSR_TYP_USEC 0
+#endif
+#if !defined(BE32K_TYP_USEC) && defined(BE32K_DELAY_MSEC)
+#define BE32K_TYP_USEC (BE32K_DELAY_MSEC * 1000)
+#endif
+
+// operations that leave the chip busy
+typedef enum {
+    FLASH_SPI_OP_PP,
+    FLASH_SPI_OP_SSE,
+    FLASH_SPI_OP_SE,
+    FLASH_SPI_OP_BE,
+    FLASH_SPI_OP_WRSR,
+    FLASH_SPI_OP_BE32K,
+#ifdef FLASH_SPI_USE_SRAM_BUFFERS
+    FLASH_SPI_OP_BUF_PP,
+    FLASH_SPI_OP_BUF_LOAD,
+#endif
+    FLASH_SPI_NUM_OPS
+} flash_spi_op_t;
+
+// an erase command and the aligned block size it erases
+typedef struct {
+    uint32_t size;
+    uint8_t cmd;
+    flash_spi_op_t op;
+    uint32_t retry_cnt;
+    uint32_t retry_delay_ms;
+} flash_spi_erase_type_t;
 
-const nlflash_info_t g_flash_spi_info =
+// at most a sector, 32K block and 64K block erase
+#define FLASH_SPI_MAX_ERASE_TYPES 3
+
+// The op for the index'th of num_types erase types in increasing size:
+// smallest, largest and any in between use the sector, 64K and 32K ops.
+static flash_spi_op_t erase_type_op(unsigned index, unsigned num_types)
+{
+    if (index == 0)
+    {
+        return FLASH_SPI_OP_SSE;
+    }
+    else if (index == num_types - 1)
+    {
+        return FLASH_SPI_OP_SE;
+    }
+    return FLASH_SPI_OP_BE32K;
+}
+
+#ifdef FLASH_SPI_USE_SRAM_BUFFERS
+// commands for each of the chip's SRAM buffers
+typedef struct {
+    uint8_t write_cmd;
+    uint8_t commit_cmd;
+    uint8_t load_cmd;
+} flash_spi_sram_buffer_t;
+
+static const flash_spi_sram_buffer_t s_sram_buffers[2] =
 {
-    .name = "SPIFlash",
-    .base_addr = 0,
-    .size = FLASH_SPI_SIZE,
-    .erase_size = FLASH_SPI_ERASE_SIZE,
-    .fast_erase_size = FLASH_SPI_FAST_ERASE_SIZE,
-    .write_size = FLASH_SPI_WRITE_SIZE
+    { CMD_BUF1_WRITE, CMD_BUF1_PP_ERASE, CMD_PAGE_TO_BUF1 },
+    { CMD_BUF2_WRITE, CMD_BUF2_PP_ERASE, CMD_PAGE_TO_BUF2 },
 };
+#endif
+
+typedef nlflash_spi_cmd_mode_t flash_spi_cmd_mode_t;
+
+#if (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_DUAL_OUTPUT)
+#define FLASH_SPI_READ_CMD_MODE { CMD_DREAD, NLSPI_LINES_SINGLE, NLSPI_LINES_DUAL, FLASH_SPI_DREAD_DUMMY_CYCLES }
+#elif (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_QUAD_OUTPUT)
+#define FLASH_SPI_READ_CMD_MODE { CMD_QREAD, NLSPI_LINES_SINGLE, NLSPI_LINES_QUAD, FLASH_SPI_QREAD_DUMMY_CYCLES }
+#elif (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_QUAD_IO)
+#define FLASH_SPI_READ_CMD_MODE { CMD_4READ, NLSPI_LINES_QUAD, NLSPI_LINES_QUAD, FLASH_SPI_4READ_DUMMY_CYCLES }
+#else
+#define FLASH_SPI_READ_CMD_MODE { FLASH_SPI_READ_CMD, NLSPI_LINES_SINGLE, NLSPI_LINES_SINGLE, FLASH_SPI_READ_DUMMY_BYTES }
+#endif
+
+#ifdef FLASH_SPI_USE_QUAD_PP
+#define FLASH_SPI_PP_CMD_MODE { CMD_4PP, NLSPI_LINES_QUAD, NLSPI_LINES_QUAD, 0 }
+#else
+#define FLASH_SPI_PP_CMD_MODE { CMD_PP, NLSPI_LINES_SINGLE, NLSPI_LINES_SINGLE, 0 }
+#endif
+
+#define FLASH_SPI_HEADER_INFO \
+{ \
+    .name = "SPIFlash", \
+    .base_addr = 0, \
+    .size = FLASH_SPI_SIZE, \
+    .erase_size = FLASH_SPI_ERASE_SIZE, \
+    .fast_erase_size = FLASH_SPI_FAST_ERASE_SIZE, \
+    .write_size = FLASH_SPI_WRITE_SIZE \
+}
+
+const nlflash_info_t g_flash_spi_info = FLASH_SPI_HEADER_INFO;
 
-// only support one flash SPI device currently
-static nlflash_spi_device_t flash_spi_device =
+// the part described by the chip header
+const nlflash_spi_chip_t g_flash_spi_chip =
 {
+    .info = FLASH_SPI_HEADER_INFO,
+#ifndef FLASH_SPI_NUM_SOURCES
+    // with several sources, the id is checked against each of them
+    .id = { FLASH_SPI_MANUFACTORY_ID, FLASH_SPI_MEMORY_TYPE_ID, FLASH_SPI_MEMORY_DENSITY_ID },
+#endif
+    .erase_cmds =
+    {
+        { FLASH_SPI_ERASE_SIZE, CMD_SSE, SSE_TYP_USEC, SSE_DELAY_LOOP_COUNT, SSE_DELAY_MSEC },
+#ifdef CMD_BE32K
+        { FLASH_SPI_FAST_ERASE_SIZE / 2, CMD_BE32K, BE32K_TYP_USEC, BE32K_DELAY_LOOP_COUNT, BE32K_DELAY_MSEC },
+#endif
+        { FLASH_SPI_FAST_ERASE_SIZE, CMD_SE, SE_TYP_USEC, SE_DELAY_LOOP_COUNT, SE_DELAY_MSEC },
+    },
+#ifdef CMD_BE32K
+    .num_erase_cmds = 3,
+#else
+    .num_erase_cmds = 2,
+#endif
+    .read_cmd_mode = FLASH_SPI_READ_CMD_MODE,
+    .pp_cmd_mode = FLASH_SPI_PP_CMD_MODE,
+    .pp_typ_usec = PP_TYP_USEC,
+    .be_typ_usec = BE_TYP_USEC,
+    .wrsr_typ_usec = WRSR_TYP_USEC,
+};
+
+// device n's part
+#ifndef FLASH_SPI_CHIP
+#define FLASH_SPI_CHIP(n) (&g_flash_spi_chip)
+#endif
+
+#ifdef FLASH_SPI_USE_SUSPEND
+// a read handed to the task that is waiting on a program or erase
+typedef struct {
+    uint32_t addr;
+    size_t len;
+    uint8_t *buf;
+    TaskHandle_t task;
+    // -EINPROGRESS until the read is served
+    volatile int result;
+} flash_spi_preempt_t;
+#endif
+
+#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
+// data written to [start, end) of the page at page_addr that hasn't been
+// programmed yet.  the rest of data is 0xFF.  end is 0 if the buffer is free.
+typedef struct {
+    uint32_t page_addr;
+    uint16_t start;
+    uint16_t end;
+    uint32_t last_use;
+    uint8_t data[FLASH_SPI_MAX_PAGE_SIZE];
+} flash_spi_page_buffer_t;
+#endif
+
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+typedef enum {
+    FLASH_SPI_POWER_OFF,
+    FLASH_SPI_POWER_ON,             // enable_ref > 0
+    FLASH_SPI_POWER_STANDBY,        // released, idle timer running
+    FLASH_SPI_POWER_POWERING_DOWN   // idle timer expired, power down pended
+} flash_spi_power_t;
+#endif
+
+typedef struct nlflash_spi_device_s {
+    const nlspi_slave_t *slave;
+#ifdef FLASH_SPI_USE_CLOCK_CALIBRATION
+    // the board's slave with the calibrated clock; slave points here
+    nlspi_slave_t cal_slave;
+#endif
+    const nlflash_spi_chip_t *chip;
+    // geometry, erase types, timings and read cmd start out as chip's
+    // and may be refined from the chip's SFDP tables
+    nlflash_info_t info;
+    flash_spi_erase_type_t erase_types[FLASH_SPI_MAX_ERASE_TYPES];
+    unsigned num_erase_types;
+    uint32_t op_typ_usec[FLASH_SPI_NUM_OPS];
+    flash_spi_cmd_mode_t read_cmd_mode;
+    flash_spi_cmd_mode_t pp_cmd_mode;
 #ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
-    .partial_page = {0},
-    .partial_page_index = 0,
-    .write_loc = 0,
+    flash_spi_page_buffer_t page_buffers[FLASH_SPI_NUM_PARTIAL_PAGE_BUFFERS];
+    uint32_t page_buffer_clock;
+#endif
+#ifdef FLASH_SPI_USE_WRITE_STREAM
+    // one page is filled by the producer while the other is programming
+    uint8_t stream_pages[2][FLASH_SPI_MAX_PAGE_SIZE];
+#endif
+    // program started by write_start, until write_finish
+    uint32_t write_addr;
+    size_t write_len;
+    const uint8_t *write_buf;
+    bool write_pending;
+    bool write_busy;
+    // erase started by erase_start, until erase_finish
+    uint32_t erase_addr;
+    const flash_spi_erase_type_t *erase_pending;
+#ifdef FLASH_SPI_USE_WRITE_VERIFY
+    // first address of the last page that didn't read back as written
+    uint32_t verify_fail_addr;
+    bool verify_failed;
+#endif
+#ifdef FLASH_SPI_USE_READ_SESSION
+    // CS stays asserted in a read command while a session is open
+    bool session_open;
+#endif
+#ifdef FLASH_SPI_USE_ASYNC_READ
+    // cmd+addr+dummy and data transfers must outlive nlflash_spi_read_async()
+    nlspi_transfer_t async_xfers[2];
+    uint8_t async_cmd[FLASH_SPI_CMD_ADDR_SIZE + FLASH_SPI_MAX_DUMMY_BYTES];
+    nlflash_async_handler_t async_callback;
+    void *async_context;
+    volatile int async_result;
+#endif
+#ifdef FLASH_SPI_USE_ADAPTIVE_BUSY_WAIT
+    // running estimate of how long each op keeps the chip busy
+    uint32_t busy_estimate_usec[FLASH_SPI_NUM_OPS];
+#endif
+#if FLASH_SPI_NEEDS_QE
+    bool quad_enabled;
+#endif
+#ifdef FLASH_SPI_USE_POWER_MODE
+    nlflash_spi_power_mode_t power_mode;
+    // L/H switch as last written; it resets to low power on power down
+    bool hp_mode;
+    bool hp_mode_known;
+    // bytes moved in the current and previous windows
+    uint32_t window_start_ms;
+    uint32_t window_bytes;
+    uint32_t prev_window_bytes;
+#endif
+#ifdef FLASH_SPI_USE_SUSPEND
+    // set while waiting on a program or erase of [busy_addr, busy_addr + busy_len)
+    // that reads from other tasks may suspend.  only changed with interrupts
+    // disabled.
+    volatile bool suspendable;
+    uint32_t busy_addr;
+    uint32_t busy_len;
+    flash_spi_preempt_t * volatile preempt;
+#endif
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+    nl_swtimer_t idle_timer;
+    // only changed with interrupts disabled
+    volatile flash_spi_power_t power;
+#endif
+#ifdef FLASH_SPI_USE_READY_GPIO
+    nlgpio_id_t ready_gpio;
+#ifndef NL_NO_RTOS
+    // task waiting for the ready irq
+    TaskHandle_t ready_task;
+#endif
+#endif
+#ifdef FLASH_SPI_USE_SRAM_BUFFERS
+    // buffer to load next, and whether the other one is being committed
+    uint8_t sram_next;
+    bool sram_busy;
+#endif
+    uint8_t enable_ref;
+} nlflash_spi_device_t;
+
+#if FLASH_SPI_NUM_DEVICES == 1
+#define FLASH_SPI_SLAVE(n) (&g_flash_spi_slave)
+#else
+#define FLASH_SPI_SLAVE(n) (&g_flash_spi_slaves[n])
+#endif
+
+#ifdef FLASH_SPI_USE_READY_GPIO
+#define FLASH_SPI_DEVICE_INIT(n) [n] = { .slave = FLASH_SPI_SLAVE(n), .chip = FLASH_SPI_CHIP(n), .ready_gpio = FLASH_SPI_READY_GPIO(n) }
+#else
+#define FLASH_SPI_DEVICE_INIT(n) [n] = { .slave = FLASH_SPI_SLAVE(n), .chip = FLASH_SPI_CHIP(n) }
+#endif
+
+// each chip has its own slave, part and state
+static nlflash_spi_device_t s_flash_spi_devices[FLASH_SPI_NUM_DEVICES] =
+{
+    FLASH_SPI_DEVICE_INIT(0),
+#if FLASH_SPI_NUM_DEVICES > 1
+    FLASH_SPI_DEVICE_INIT(1),
+#endif
+#if FLASH_SPI_NUM_DEVICES > 2
+    FLASH_SPI_DEVICE_INIT(2),
+#endif
+#if FLASH_SPI_NUM_DEVICES > 3
+    FLASH_SPI_DEVICE_INIT(3),
 #endif
-    .enable_ref = 0
 };
 
-static int read_register(uint8_t cmd, uint8_t *buf, uint8_t num_bytes);
+static int read_register(nlflash_spi_device_t *dev, uint8_t cmd, uint8_t *buf, uint8_t num_bytes);
+#ifdef FLASH_SPI_USE_CLOCK_CALIBRATION
+static int write_internal(nlflash_spi_device_t *dev, uint32_t addr, size_t len, const uint8_t *buf);
+#endif
+static int flash_spi_release(nlflash_spi_device_t *dev);
+static int flash_spi_flush(nlflash_spi_device_t *dev);
+#if FLASH_SPI_NEEDS_QE
+static int enable_quad(nlflash_spi_device_t *dev);
+#endif
 
-static int check_chip_id(void)
+static int check_chip_id(nlflash_spi_device_t *dev)
 {
     int retval;
     uint8_t id_buf[FLASH_SPI_READ_ID_SIZE] = {0};
 
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-    retval = nlspi_request(&g_flash_spi_slave);
+    retval = nlspi_request(dev->slave);
     if (retval < 0)
         return retval;
 #endif
 
-    retval = read_register(CMD_RDID, id_buf, sizeof(id_buf));
+    retval = read_register(dev, CMD_RDID, id_buf, sizeof(id_buf));
     nlREQUIRE(retval >= 0, done);
 
 #ifdef FLASH_SPI_NUM_SOURCES
+    // the chip header's part may come from any of several sources
+    if (dev->chip == &g_flash_spi_chip)
+    {
+        int i;
 
-    int i;
+        for (i = 0 ; i < FLASH_SPI_NUM_SOURCES ; i++)
+        {
+            if (id_buf[0] == FLASH_SPI_MANUFACTORY_ID(i) &&
+                id_buf[1] == FLASH_SPI_MEMORY_TYPE_ID(i) &&
+                id_buf[2] == FLASH_SPI_MEMORY_DENSITY_ID(i))
+            {
+                break;
+            }
+        }
 
-    for (i = 0 ; i < FLASH_SPI_NUM_SOURCES ; i++)
-    {
-        if (id_buf[0] == FLASH_SPI_MANUFACTORY_ID(i) &&
-            id_buf[1] == FLASH_SPI_MEMORY_TYPE_ID(i) &&
-            id_buf[2] == FLASH_SPI_MEMORY_DENSITY_ID(i))
+        if (i < FLASH_SPI_NUM_SOURCES)
         {
-            break;
+            FLASH_SPI_SET_SOURCE(i);
+        }
+        else
+        {
+            retval = -1; // check ID failed
         }
+        goto done;
     }
+#endif
 
-    if (i < FLASH_SPI_NUM_SOURCES)
-    {
-        FLASH_SPI_SET_SOURCE(i);
-    }
-    else
+    if (memcmp(id_buf, dev->chip->id, sizeof(dev->chip->id)) != 0)
     {
         retval = -1; // check ID failed
     }
 
-#else
+done:
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+#endif
+    return retval;
+}
+
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+static void power_down(nlflash_spi_device_t *dev);
+
+// runs in the timer service task
+static void power_down_idle(void *arg, uint32_t unused)
+{
+    nlflash_spi_device_t *dev = arg;
+
+    power_down(dev);
+
+    nlplatform_interrupt_disable();
+    dev->power = FLASH_SPI_POWER_OFF;
+    nlplatform_interrupt_enable();
+}
 
-    if (id_buf[0] != FLASH_SPI_MANUFACTORY_ID ||
-        id_buf[1] != FLASH_SPI_MEMORY_TYPE_ID ||
-        id_buf[2] != FLASH_SPI_MEMORY_DENSITY_ID)
+// runs in interrupt context, so hand the spi traffic off to a task
+static uint32_t idle_timer_expired(nl_swtimer_t *timer, void *arg)
+{
+    nlflash_spi_device_t *dev = arg;
+    BaseType_t yield = pdFALSE;
+
+    // a request may have raced the timer
+    if (dev->power != FLASH_SPI_POWER_STANDBY)
     {
-        retval = -1; // check ID failed
+        return 0;
     }
 
-#endif
+    if (xTimerPendFunctionCallFromISR(power_down_idle, dev, 0, &yield) != pdPASS)
+    {
+        // timer command queue is full, try again later
+        return FLASH_SPI_POWERDOWN_IDLE_MSEC;
+    }
+    dev->power = FLASH_SPI_POWER_POWERING_DOWN;
+    portYIELD_FROM_ISR(yield);
+    return 0;
+}
 
-done:
-#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-    nlspi_release(&g_flash_spi_slave);
-#endif
-    return retval;
+// Called for the first request after a release.  Returns true if the
+// chip was still in standby, in which case it's ready to use as is.
+// Otherwise it's off and needs powering up.
+static bool resume_from_standby(nlflash_spi_device_t *dev)
+{
+    flash_spi_power_t power;
+
+    while (true)
+    {
+        nlplatform_interrupt_disable();
+        nl_swtimer_cancel(&dev->idle_timer);
+        power = dev->power;
+        if (power != FLASH_SPI_POWER_POWERING_DOWN)
+        {
+            dev->power = FLASH_SPI_POWER_ON;
+        }
+        nlplatform_interrupt_enable();
+
+        if (power != FLASH_SPI_POWER_POWERING_DOWN)
+        {
+            return (power == FLASH_SPI_POWER_STANDBY);
+        }
+
+        // let the power down finish before powering back up
+        nlplatform_delay_ms(1);
+    }
 }
+#endif /* FLASH_SPI_POWERDOWN_IDLE_MSEC > 0 */
 
-int nlflash_spi_request(void)
+static int flash_spi_request(nlflash_spi_device_t *dev)
 {
     int retval = 0;
     int attempts = FLASH_SPI_NUMBER_REQUEST_ATTEMPTS;
 
-    flash_spi_device.enable_ref++;
-    if (flash_spi_device.enable_ref > 1)
+    dev->enable_ref++;
+    if (dev->enable_ref > 1)
+    {
+        goto done;
+    }
+
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+    if (resume_from_standby(dev))
     {
         goto done;
     }
+#endif
 
     while (attempts > 0)
     {
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 0)
         // request the SPI bus and keep it for duration of request.
-        retval = nlspi_request(&g_flash_spi_slave);
+        retval = nlspi_request(dev->slave);
         if (retval < 0)
         {
             // undo ref count increment
-            flash_spi_device.enable_ref = 0;
+            dev->enable_ref = 0;
             goto done;
         }
 #else
@@ -171,7 +769,7 @@ int nlflash_spi_request(void)
         // spi controller during read/write transactions, to keep
         // the spi controller available to other devices that might
         // want to use it during long flash operations.
-        nlspi_slave_enable(&g_flash_spi_slave);
+        nlspi_slave_enable(dev->slave);
 #endif
 
 #ifdef FLASH_SPI_USE_POWERDOWN
@@ -180,11 +778,11 @@ int nlflash_spi_request(void)
         // CS to go high at end of the cmd.
         {
             const uint8_t cmd_rdp[1] = {CMD_RDP};
-            retval = nlspi_write(&g_flash_spi_slave, cmd_rdp, sizeof(cmd_rdp));
+            retval = nlspi_write(dev->slave, cmd_rdp, sizeof(cmd_rdp));
             if (retval < 0)
             {
                 // undo ref count increment
-                flash_spi_device.enable_ref = 0;
+                dev->enable_ref = 0;
                 goto done;
             }
         }
@@ -194,8 +792,17 @@ int nlflash_spi_request(void)
         // state for interaction.
         for (unsigned i = 0; i < FLASH_SPI_MAX_CHIP_ID_CHECK_COUNT; i++)
         {
-            if (check_chip_id() >= 0) {
+            if (check_chip_id(dev) >= 0) {
                 retval = 0;
+#if FLASH_SPI_NEEDS_QE
+                if (!dev->quad_enabled) {
+                    retval = enable_quad(dev);
+                    if (retval < 0) {
+                        // undo ref count increment
+                        flash_spi_release(dev);
+                    }
+                }
+#endif
                 goto done;
             }
             nlplatform_delay_ms(1);
@@ -203,16 +810,19 @@ int nlflash_spi_request(void)
 
         // ID check error, turn off flash and possibly try again
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 0)
-        nlspi_release(&g_flash_spi_slave);
+        nlspi_release(dev->slave);
 #else
-        nlspi_slave_disable(&g_flash_spi_slave);
+        nlspi_slave_disable(dev->slave);
 #endif
         attempts--;
     }
 
     // We power cycled external flash several times and were unable to get a chip ID
     // Undo ref count and return error
-    flash_spi_device.enable_ref = 0;
+    dev->enable_ref = 0;
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+    dev->power = FLASH_SPI_POWER_OFF;
+#endif
     retval = -1;
 done:
 #if (FLASH_SPI_FAULT_ON_REQUEST_FAILURE)
@@ -224,34 +834,57 @@ done:
     return retval;
 }
 
-int nlflash_spi_release(void)
+static void power_down(nlflash_spi_device_t *dev)
 {
-    nlASSERT(flash_spi_device.enable_ref > 0);
-    flash_spi_device.enable_ref--;
-    if (flash_spi_device.enable_ref == 0)
-    {
+#ifdef FLASH_SPI_USE_POWER_MODE
+    dev->hp_mode_known = false;
+#endif
 #ifdef FLASH_SPI_USE_POWERDOWN
-        // send deep powerdown cmd
-        const uint8_t cmd_dp[1] = {CMD_DP};
-        nlspi_write(&g_flash_spi_slave, cmd_dp, sizeof(cmd_dp));
+    // send deep powerdown cmd
+    const uint8_t cmd_dp[1] = {CMD_DP};
+    nlspi_write(dev->slave, cmd_dp, sizeof(cmd_dp));
 #endif
 
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 0)
-        // Allow access to SPI bus now that flash regulator is disabled.
-        nlspi_release(&g_flash_spi_slave);
+    // Allow access to SPI bus now that flash regulator is disabled.
+    nlspi_release(dev->slave);
+#else
+    // Disable the flash spi power and control lines
+    nlspi_slave_disable(dev->slave);
+#endif
+}
+
+static int flash_spi_release(nlflash_spi_device_t *dev)
+{
+    nlASSERT(dev->enable_ref > 0);
+    dev->enable_ref--;
+    if (dev->enable_ref == 0)
+    {
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+        // leave the chip in standby until it's been idle a while
+        nlplatform_interrupt_disable();
+        dev->power = FLASH_SPI_POWER_STANDBY;
+        nl_swtimer_start(&dev->idle_timer, FLASH_SPI_POWERDOWN_IDLE_MSEC);
+        nlplatform_interrupt_enable();
 #else
-        // Disable the flash spi power and control lines
-        nlspi_slave_disable(&g_flash_spi_slave);
+        power_down(dev);
 #endif
     }
     return 0;
 }
 
 // read a register with the given size
-static int read_register(uint8_t cmd, uint8_t *buf, uint8_t num_bytes)
+static int read_register(nlflash_spi_device_t *dev, uint8_t cmd, uint8_t *buf, uint8_t num_bytes)
 {
     nlspi_transfer_t xfers[2];
 
+#ifdef FLASH_SPI_USE_READ_SESSION
+    if (dev->session_open)
+    {
+        return -EBUSY;
+    }
+#endif
+
     xfers[0].tx = &cmd;
     xfers[0].rx = NULL;
     xfers[0].num = sizeof(cmd);
@@ -261,14 +894,14 @@ static int read_register(uint8_t cmd, uint8_t *buf, uint8_t num_bytes)
     xfers[1].num = num_bytes;
     xfers[1].callback = NULL;
 
-    return nlspi_transfer(&g_flash_spi_slave, xfers, ARRAY_SIZE(xfers));
+    return nlspi_transfer(dev->slave, xfers, ARRAY_SIZE(xfers));
 }
 
-static int flash_is_busy(void)
+static int flash_is_busy(nlflash_spi_device_t *dev)
 {
     int retval;
     uint8_t status;
-    retval = read_register(CMD_RDSR, &status, sizeof(status));
+    retval = read_register(dev, CMD_RDSR, &status, sizeof(status));
     if (retval) {
         return retval;
     }
@@ -278,21 +911,9 @@ static int flash_is_busy(void)
     return 0;
 }
 
-// Sends a multi-part transaction via spi.
-// If this is a write operation, it first sends a WREN cmd as a separate
-// spi transfer (CS required to go high at end of cmd).
-// Then it sends the cmd+address.
-// Optionally, if there is data transfer involved, it will send dummy_bytes
-// and then the transfer.
-static int spi_cmd_address_data(uint8_t cmd, uint32_t address, bool write, uint8_t *buf, size_t len, uint8_t dummy_bytes)
+// Fills cmd_buf with the cmd byte followed by the 3 byte address.
+static void fill_cmd_address(uint8_t *cmd_buf, uint8_t cmd, uint32_t address)
 {
-    int retval;
-    nlspi_transfer_t xfers[2]; // max 2 transactions, one for cmd+addr+dummy, and one for data
-    uint8_t cmd_buf[4];
-#ifdef CMD_WREN
-    const uint8_t wren[1] = {CMD_WREN};
-#endif
-
     // for devices like at45db041e with non-binary multiple page sizes,
     // the address format is page + page offset
 #if (FLASH_SPI_USE_PAGE_OFFSET_ADDRESSING == 1)
@@ -307,483 +928,2721 @@ static int spi_cmd_address_data(uint8_t cmd, uint32_t address, bool write, uint8
     cmd_buf[2] = ((address >> 8) & 0xFF);
     cmd_buf[1] = ((address >> 16) & 0xFF);
     cmd_buf[0] = cmd;
+}
 
-#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-    retval = nlspi_request(&g_flash_spi_slave);
-    if (retval < 0)
-        return retval;
-#endif
+// Fills cmd_buf with mode's cmd, address and dummy bytes, and xfers with
+// the transfers that send them, splitting the cmd off if the address goes
+// out on more lines than the cmd.  lines gets the number of lines for each
+// transfer.  Returns the number of transfers, at most 2.
+static unsigned fill_cmd_xfers(const flash_spi_cmd_mode_t *mode, uint32_t address, uint8_t *cmd_buf,
+                               nlspi_transfer_t *xfers, uint8_t *lines)
+{
+    unsigned num_xfers;
+
+    nlASSERT(mode->dummy_bytes <= FLASH_SPI_MAX_DUMMY_BYTES);
+
+    fill_cmd_address(cmd_buf, mode->cmd, address);
+    // all 1s dummy bytes keep quad I/O reads out of continuous read mode
+    memset(&cmd_buf[FLASH_SPI_CMD_ADDR_SIZE], 0xff, mode->dummy_bytes);
+
+    if (mode->addr_lines == NLSPI_LINES_SINGLE) {
+        xfers[0].tx = cmd_buf;
+        xfers[0].rx = NULL;
+        xfers[0].num = FLASH_SPI_CMD_ADDR_SIZE + mode->dummy_bytes;
+        xfers[0].callback = NULL;
+        num_xfers = 1;
+    } else {
+        xfers[0].tx = cmd_buf;
+        xfers[0].rx = NULL;
+        xfers[0].num = 1;
+        xfers[0].callback = NULL;
+        xfers[1].tx = &cmd_buf[1];
+        xfers[1].rx = NULL;
+        xfers[1].num = FLASH_SPI_CMD_ADDR_SIZE - 1 + mode->dummy_bytes;
+        xfers[1].callback = NULL;
+        num_xfers = 2;
+    }
+    lines[0] = NLSPI_LINES_SINGLE;
+    lines[num_xfers - 1] = mode->addr_lines;
 
-    // abort if FLASH chip is busy
-    retval = flash_is_busy();
-    nlREQUIRE(retval >= 0, err_path);
+    return num_xfers;
+}
 
-#ifdef CMD_WREN
-    // send WREN cmd if this is a write operation.  this must be a separate transaction
-    // from the rest because the chip requires CS to go high at end of WREN cmd.
-    if (write) {
-        retval = nlspi_write(&g_flash_spi_slave, wren, sizeof(wren));
-        nlREQUIRE(retval >= 0, err_path);
+// Sends a multi-part transaction via spi.
+// If this is a write operation, it first sends a WREN cmd as a separate
+// spi transfer (CS required to go high at end of cmd).
+// Then it sends the cmd+address, with the address on mode->addr_lines.
+// Optionally, if there is data transfer involved, it will send dummy_bytes
+// and then the num_segs data segments, back to back, on mode->data_lines.
+static int spi_cmd_mode_address_segs(nlflash_spi_device_t *dev, const flash_spi_cmd_mode_t *mode, uint32_t address, bool write,
+                                     const nlflash_iovec_t *segs, unsigned num_segs)
+{
+    int retval;
+    // cmd, addr+dummy, and data
+    nlspi_transfer_t xfers[2 + FLASH_SPI_MAX_IOVECS];
+    unsigned num_xfers;
+    uint8_t cmd_buf[FLASH_SPI_CMD_ADDR_SIZE + FLASH_SPI_MAX_DUMMY_BYTES];
+    uint8_t lines[2 + FLASH_SPI_MAX_IOVECS];
+#ifdef CMD_WREN
+    const uint8_t wren[1] = {CMD_WREN};
+#endif
+
+#ifdef FLASH_SPI_USE_READ_SESSION
+    // the chip is in the middle of the session's read command
+    if (dev->session_open)
+    {
+        return -EBUSY;
     }
 #endif
 
-    // send cmd and address + dummy bytes.  For dummy bytes, it will wind up
-    // sending garbage from stack past cmd address, but that should be okay.
-    xfers[0].tx = cmd_buf;
-    xfers[0].rx = NULL;
-    xfers[0].num = sizeof(cmd_buf) + dummy_bytes;
-    xfers[0].callback = NULL;
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    if (retval < 0)
+        return retval;
+#endif
+
+    // abort if FLASH chip is busy
+    retval = flash_is_busy(dev);
+    nlREQUIRE(retval >= 0, err_path);
+
+#ifdef CMD_WREN
+    // send WREN cmd if this is a write operation.  this must be a separate transaction
+    // from the rest because the chip requires CS to go high at end of WREN cmd.
+    if (write) {
+        retval = nlspi_write(dev->slave, wren, sizeof(wren));
+        nlREQUIRE(retval >= 0, err_path);
+    }
+#endif
 
-    if (len) {
+    // send cmd and address + dummy bytes
+    num_xfers = fill_cmd_xfers(mode, address, cmd_buf, xfers, lines);
+
+    nlASSERT(num_segs <= FLASH_SPI_MAX_IOVECS);
+    for (unsigned i = 0; i < num_segs; i++) {
+        if (segs[i].len == 0) {
+            continue;
+        }
         if (write) {
-            xfers[1].tx = buf;
-            xfers[1].rx = NULL;
+            xfers[num_xfers].tx = segs[i].base;
+            xfers[num_xfers].rx = NULL;
         } else {
-            xfers[1].tx = NULL;
-            xfers[1].rx = buf;
+            xfers[num_xfers].tx = NULL;
+            xfers[num_xfers].rx = segs[i].base;
         }
-        xfers[1].num = len;
-        xfers[1].callback = NULL;
+        xfers[num_xfers].num = segs[i].len;
+        xfers[num_xfers].callback = NULL;
+        lines[num_xfers] = mode->data_lines;
+        num_xfers++;
+    }
+
+#if FLASH_SPI_MULTI_LINE
+    if ((mode->addr_lines != NLSPI_LINES_SINGLE) || (mode->data_lines != NLSPI_LINES_SINGLE)) {
+        retval = nlspi_transfer_lines(dev->slave, xfers, lines, num_xfers);
+    } else
+#endif
+    {
+        retval = nlspi_transfer(dev->slave, xfers, num_xfers);
     }
-    retval = nlspi_transfer(&g_flash_spi_slave, xfers, len ? 2 : 1);
     nlREQUIRE(retval >= 0, err_path);
 
 err_path:
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-    nlspi_release(&g_flash_spi_slave);
+    nlspi_release(dev->slave);
 #endif
     return retval;
 }
 
-// poll status register of chip until it's not busy or we timeout
-static int wait_until_not_busy(uint32_t retry_cnt, uint32_t retry_delay_ms)
+static int spi_cmd_mode_address_data(nlflash_spi_device_t *dev, const flash_spi_cmd_mode_t *mode, uint32_t address, bool write, uint8_t *buf, size_t len)
+{
+    const nlflash_iovec_t seg = { buf, len };
+
+    return spi_cmd_mode_address_segs(dev, mode, address, write, &seg, 1);
+}
+
+// single line version of spi_cmd_mode_address_data()
+static int spi_cmd_address_data(nlflash_spi_device_t *dev, uint8_t cmd, uint32_t address, bool write, uint8_t *buf, size_t len, uint8_t dummy_bytes)
+{
+    const flash_spi_cmd_mode_t mode = { cmd, NLSPI_LINES_SINGLE, NLSPI_LINES_SINGLE, dummy_bytes };
+
+    return spi_cmd_mode_address_data(dev, &mode, address, write, buf, len);
+}
+
+// read the status register, requesting the spi controller if needed
+static int read_status(nlflash_spi_device_t *dev, uint8_t *status)
 {
     int retval;
-    uint8_t status = 0;
 
-    do {
-        nlplatform_delay_ms(retry_delay_ms);
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-        retval = nlspi_request(&g_flash_spi_slave);
-        nlREQUIRE(retval >= 0, err_path);
+    retval = nlspi_request(dev->slave);
+    if (retval < 0)
+        return retval;
+#endif
+    retval = read_register(dev, CMD_RDSR, status, sizeof(*status));
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+#endif
+    return retval;
+}
+
+// sleep for the whole ms part of the delay and spin for the rest
+static void delay_usec(uint32_t usec)
+{
+    if (usec >= 1000) {
+        nlplatform_delay_ms(usec / 1000);
+    }
+    if (usec % 1000) {
+        nlplatform_delay_us(usec % 1000);
+    }
+}
+
+#ifdef FLASH_SPI_USE_SUSPEND
+// send a cmd with no address or data
+static int send_cmd(nlflash_spi_device_t *dev, uint8_t cmd)
+{
+    int retval;
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    if (retval < 0)
+        return retval;
 #endif
-        retval = read_register(CMD_RDSR, &status, sizeof(status));
+    retval = nlspi_write(dev->slave, &cmd, sizeof(cmd));
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-        nlspi_release(&g_flash_spi_slave);
+    nlspi_release(dev->slave);
+#endif
+    return retval;
+}
+
+// Serve the read posted by nlflash_spi_read_preempt(), if any, suspending
+// the program or erase in progress around it when busy is set.  The read's
+// result goes to the posting task; the return value is whether the op
+// could be resumed.
+static int serve_preempt(nlflash_spi_device_t *dev, bool busy)
+{
+    flash_spi_preempt_t *preempt = dev->preempt;
+    TaskHandle_t task;
+    int retval = 0;
+    int resume_retval = 0;
+    uint8_t status = 0;
+
+    if (preempt == NULL) {
+        return 0;
+    }
+
+    if (busy) {
+        retval = send_cmd(dev, CMD_SUSPEND);
+        if (retval >= 0) {
+            nlplatform_delay_us(SUSPEND_LATENCY_USEC);
+            retval = read_status(dev, &status);
+        }
+        // the chip ignores suspend in some states, e.g. right after a resume
+        if ((retval >= 0) && ((status & M_STAT_BUSY_BIT) != M_STAT_READY_VALUE)) {
+            retval = -EAGAIN;
+        }
+    }
+
+    if (retval >= 0) {
+        retval = spi_cmd_mode_address_data(dev, &dev->read_cmd_mode, preempt->addr, false, preempt->buf, preempt->len);
+    }
+
+    if (busy) {
+        // resume is ignored if the op finished before it could be suspended
+        resume_retval = send_cmd(dev, CMD_RESUME);
+    }
+
+    // the posting task may return as soon as result is set, taking
+    // preempt with it, so that's the last use of it
+    task = preempt->task;
+    dev->preempt = NULL;
+    preempt->result = retval;
+    xTaskNotifyGive(task);
+
+    return resume_retval;
+}
+
+// delay while the chip is busy with an op, serving any preempting reads
+// every FLASH_SPI_SUSPEND_POLL_MSEC.  time spent serving reads isn't
+// counted, since the op makes no progress while suspended.
+static int busy_delay_usec(nlflash_spi_device_t *dev, uint32_t usec)
+{
+    int retval = 0;
+
+    while ((usec > FLASH_SPI_SUSPEND_POLL_MSEC * 1000) && (retval >= 0)) {
+        delay_usec(FLASH_SPI_SUSPEND_POLL_MSEC * 1000);
+        usec -= FLASH_SPI_SUSPEND_POLL_MSEC * 1000;
+        retval = serve_preempt(dev, true);
+    }
+    if (retval >= 0) {
+        delay_usec(usec);
+    }
+    return retval;
+}
+
+// let reads outside [addr, addr + len) preempt the op being waited on
+static void start_suspendable(nlflash_spi_device_t *dev, uint32_t addr, uint32_t len)
+{
+    nlplatform_interrupt_disable();
+    dev->busy_addr = addr;
+    dev->busy_len = len;
+    dev->suspendable = true;
+    nlplatform_interrupt_enable();
+}
+
+static void end_suspendable(nlflash_spi_device_t *dev)
+{
+    nlplatform_interrupt_disable();
+    dev->suspendable = false;
+    nlplatform_interrupt_enable();
+
+    // a read may have been posted after the last check in the wait
+    serve_preempt(dev, false);
+}
+#else /* !defined(FLASH_SPI_USE_SUSPEND) */
+static int busy_delay_usec(nlflash_spi_device_t *dev, uint32_t usec)
+{
+    delay_usec(usec);
+    return 0;
+}
+
+static void start_suspendable(nlflash_spi_device_t *dev, uint32_t addr, uint32_t len)
+{
+}
+
+static void end_suspendable(nlflash_spi_device_t *dev)
+{
+}
+#endif /* defined(FLASH_SPI_USE_SUSPEND) */
+
+#if defined(FLASH_SPI_USE_READY_GPIO)
+
+#ifndef NL_NO_RTOS
+static void ready_gpio_isr(const nlgpio_id_t gpio, void *data)
+{
+    nlflash_spi_device_t *dev = (nlflash_spi_device_t *)data;
+    BaseType_t yield = pdFALSE;
+
+    vTaskNotifyGiveFromISR(dev->ready_task, &yield);
+    portYIELD_FROM_ISR(yield);
+}
 #endif
+
+// wait for the ready/busy output to show the chip is ready or we timeout.
+// the timeout is the same as the status poller's retry_cnt * retry_delay_ms.
+static int wait_until_not_busy(nlflash_spi_device_t *dev, flash_spi_op_t op, uint32_t retry_cnt, uint32_t retry_delay_ms)
+{
+    int retval = 0;
+#ifndef NL_NO_RTOS
+    TickType_t start = xTaskGetTickCount();
+    TickType_t timeout = pdMS_TO_TICKS(retry_cnt * retry_delay_ms);
+
+    dev->ready_task = xTaskGetCurrentTaskHandle();
+    retval = nlgpio_irq_request(dev->ready_gpio, FLASH_SPI_READY_GPIO_IRQ_FLAGS, ready_gpio_isr, dev);
+    if (retval < 0) {
+        return retval;
+    }
+
+    // check the pin after enabling the irq, so an op that completes
+    // in between isn't missed.  a notification left over from an earlier
+    // wait just means another check.
+    while (nlgpio_get_value(dev->ready_gpio) != FLASH_SPI_READY_GPIO_VALUE) {
+        TickType_t waited = xTaskGetTickCount() - start;
+
+        if (waited >= timeout) {
+            retval = -EIO;
+            break;
+        }
+        ulTaskNotifyTake(pdTRUE, timeout - waited);
+    }
+
+    nlgpio_irq_release(dev->ready_gpio);
+#else /* defined(NL_NO_RTOS) */
+    uint32_t timeout_usec = retry_cnt * retry_delay_ms * 1000;
+    uint32_t elapsed_usec = 0;
+
+    while (nlgpio_get_value(dev->ready_gpio) != FLASH_SPI_READY_GPIO_VALUE) {
+        if (elapsed_usec >= timeout_usec) {
+            return -EIO;
+        }
+        delay_usec(FLASH_SPI_READY_POLL_USEC);
+        elapsed_usec += FLASH_SPI_READY_POLL_USEC;
+    }
+#endif /* !defined(NL_NO_RTOS) */
+
+    return retval;
+}
+#elif defined(FLASH_SPI_USE_ADAPTIVE_BUSY_WAIT)
+
+// Sleep until just before op is expected to complete, then poll status at
+// a fine granularity, backing off exponentially if the chip takes longer
+// than expected.  The time op actually took is folded into the running
+// estimate.  Times are accounted from our own delays rather than the system
+// clock, which may only have ms resolution.  The timeout is the same as the
+// fixed poller's retry_cnt * retry_delay_ms.
+static int wait_until_not_busy(nlflash_spi_device_t *dev, flash_spi_op_t op, uint32_t retry_cnt, uint32_t retry_delay_ms)
+{
+    int retval;
+    uint8_t status = 0;
+    uint32_t *estimate = &dev->busy_estimate_usec[op];
+    uint32_t timeout_usec = retry_cnt * retry_delay_ms * 1000;
+    uint32_t max_poll_usec = retry_delay_ms * 1000;
+    uint32_t poll_usec = FLASH_SPI_BUSY_POLL_USEC;
+    uint32_t elapsed_usec;
+
+    elapsed_usec = *estimate - (*estimate >> FLASH_SPI_BUSY_EARLY_SHIFT);
+    retval = busy_delay_usec(dev, elapsed_usec);
+    if (retval < 0) {
+        return retval;
+    }
+
+    while (true) {
+        retval = read_status(dev, &status);
+        if (retval < 0) {
+            return retval;
+        }
+        if ((status & M_STAT_BUSY_BIT) == M_STAT_READY_VALUE) {
+            break;
+        }
+        if (elapsed_usec >= timeout_usec) {
+            return -EIO;
+        }
+        retval = busy_delay_usec(dev, poll_usec);
+        if (retval < 0) {
+            return retval;
+        }
+        elapsed_usec += poll_usec;
+        poll_usec = MIN(poll_usec * 2, max_poll_usec);
+    }
+
+    *estimate = (int32_t)*estimate + (((int32_t)elapsed_usec - (int32_t)*estimate) >> FLASH_SPI_BUSY_AVERAGE_SHIFT);
+
+    return retval;
+}
+#else /* !defined(FLASH_SPI_USE_READY_GPIO) && !defined(FLASH_SPI_USE_ADAPTIVE_BUSY_WAIT) */
+// poll status register of chip until it's not busy or we timeout
+static int wait_until_not_busy(nlflash_spi_device_t *dev, flash_spi_op_t op, uint32_t retry_cnt, uint32_t retry_delay_ms)
+{
+    int retval;
+    uint8_t status = 0;
+
+    do {
+        retval = busy_delay_usec(dev, retry_delay_ms * 1000);
+        if (retval < 0) {
+            return retval;
+        }
+        retval = read_status(dev, &status);
         if ((status & M_STAT_BUSY_BIT) == M_STAT_READY_VALUE) {
             break;
         }
         retry_cnt--;
     } while ((retry_cnt > 0) && (retval >= 0));
-#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-err_path:
-#endif
     if (retry_cnt == 0) {
         return -EIO;
     }
     return retval;
 }
+#endif /* defined(FLASH_SPI_USE_READY_GPIO) */
+
+#if FLASH_SPI_NEEDS_QE || defined(FLASH_SPI_USE_POWER_MODE)
+// write num_regs bytes of status (and, on some chips, configuration)
+// registers and wait for the write to complete
+static int write_status(nlflash_spi_device_t *dev, const uint8_t *regs, uint8_t num_regs)
+{
+    int retval;
+    uint8_t cmd_buf[4];
+    const uint8_t wren[1] = {CMD_WREN};
+
+    nlASSERT(num_regs < sizeof(cmd_buf));
+    cmd_buf[0] = CMD_WRSR;
+    memcpy(&cmd_buf[1], regs, num_regs);
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    if (retval < 0)
+        return retval;
+#endif
+    retval = nlspi_write(dev->slave, wren, sizeof(wren));
+    if (retval >= 0) {
+        retval = nlspi_write(dev->slave, cmd_buf, num_regs + 1);
+    }
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+#endif
+    nlREQUIRE(retval >= 0, done);
+
+    retval = wait_until_not_busy(dev, FLASH_SPI_OP_WRSR, WRSR_DELAY_LOOP_COUNT, WRSR_DELAY_MSEC);
+done:
+    return retval;
+}
+#endif /* FLASH_SPI_NEEDS_QE || defined(FLASH_SPI_USE_POWER_MODE) */
+
+#if FLASH_SPI_NEEDS_QE
+
+// Quad transfers need IO2/IO3 to be data lines rather than WP#/HOLD#.
+// QE is non-volatile, so this normally only writes once in the life of
+// the chip.
+static int enable_quad(nlflash_spi_device_t *dev)
+{
+    int retval;
+    uint8_t status;
+
+    retval = read_status(dev, &status);
+    nlREQUIRE(retval >= 0, done);
+
+    if ((status & M_STAT_QE) == 0) {
+        status |= M_STAT_QE;
+        retval = write_status(dev, &status, sizeof(status));
+        nlREQUIRE(retval >= 0, done);
+    }
+    dev->quad_enabled = true;
+
+done:
+    return retval;
+}
+#endif /* FLASH_SPI_NEEDS_QE */
+
+#ifdef FLASH_SPI_USE_POWER_MODE
+// WRSR writes the status register and both configuration registers, so
+// read them all and only change the L/H switch.
+static int set_hp_mode(nlflash_spi_device_t *dev, bool hp_mode)
+{
+    int retval;
+    uint8_t regs[3];
+
+    retval = read_status(dev, &regs[0]);
+    nlREQUIRE(retval >= 0, done);
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    nlREQUIRE(retval >= 0, done);
+#endif
+    retval = read_register(dev, CMD_RDCR, &regs[1], 2);
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+#endif
+    nlREQUIRE(retval >= 0, done);
+
+    // the chip comes up in low power mode, so this usually only writes
+    // when the policy changes its mind
+    if (((regs[2] & M_CR2_HP_MODE) != 0) != hp_mode)
+    {
+        if (hp_mode)
+        {
+            regs[2] |= M_CR2_HP_MODE;
+        }
+        else
+        {
+            regs[2] &= ~M_CR2_HP_MODE;
+        }
+        retval = write_status(dev, regs, sizeof(regs));
+        nlREQUIRE(retval >= 0, done);
+    }
+
+    dev->hp_mode = hp_mode;
+    dev->hp_mode_known = true;
+
+done:
+    return retval;
+}
+
+// Account for len bytes about to be moved and switch the chip to the mode
+// the policy wants.  Called with the chip requested and idle.  Failing to
+// switch isn't fatal to the op; the switch is retried next time.
+static void power_mode_update(nlflash_spi_device_t *dev, size_t len)
+{
+    uint32_t now = (uint32_t)nltime_get_system_ms();
+    uint32_t elapsed = now - dev->window_start_ms;
+    bool hp_mode;
+
+    if (elapsed >= FLASH_SPI_HP_MODE_WINDOW_MSEC)
+    {
+        // the previous window only counts if it's the one just ended
+        dev->prev_window_bytes = (elapsed < 2 * FLASH_SPI_HP_MODE_WINDOW_MSEC) ? dev->window_bytes : 0;
+        dev->window_bytes = 0;
+        dev->window_start_ms = now;
+    }
+    dev->window_bytes = (len > UINT32_MAX - dev->window_bytes) ? UINT32_MAX : dev->window_bytes + len;
+
+    switch (dev->power_mode)
+    {
+        case NLFLASH_SPI_POWER_MODE_LOW_POWER:
+            hp_mode = false;
+            break;
+        case NLFLASH_SPI_POWER_MODE_HIGH_PERFORMANCE:
+            hp_mode = true;
+            break;
+        default:
+            hp_mode = (dev->window_bytes >= FLASH_SPI_HP_MODE_MIN_BYTES) ||
+                      (dev->prev_window_bytes >= FLASH_SPI_HP_MODE_MIN_BYTES);
+            break;
+    }
+
+    if (!dev->hp_mode_known || (dev->hp_mode != hp_mode))
+    {
+        set_hp_mode(dev, hp_mode);
+    }
+}
+#else /* !defined(FLASH_SPI_USE_POWER_MODE) */
+static void power_mode_update(nlflash_spi_device_t *dev, size_t len)
+{
+}
+#endif /* defined(FLASH_SPI_USE_POWER_MODE) */
+
+static int erase_block_wait(nlflash_spi_device_t *dev, const flash_spi_erase_type_t *erase_type, uint32_t addr)
+{
+    int retval;
+
+    start_suspendable(dev, addr, erase_type->size);
+    retval = wait_until_not_busy(dev, erase_type->op, erase_type->retry_cnt, erase_type->retry_delay_ms);
+    end_suspendable(dev);
+
+    return retval;
+}
+
+static int erase_block(nlflash_spi_device_t *dev, const flash_spi_erase_type_t *erase_type, uint32_t addr)
+{
+    int retval;
+
+    retval = spi_cmd_address_data(dev, erase_type->cmd, addr, true, NULL, 0, 0);
+    nlREQUIRE(retval >= 0, err_path);
+
+    retval = erase_block_wait(dev, erase_type, addr);
+
+err_path:
+    return retval;
+}
+
+// expected time for an op, measured if we're measuring, else from the datasheet
+static uint32_t op_time_usec(nlflash_spi_device_t *dev, flash_spi_op_t op)
+{
+#ifdef FLASH_SPI_USE_ADAPTIVE_BUSY_WAIT
+    return dev->busy_estimate_usec[op];
+#else
+    return dev->op_typ_usec[op];
+#endif
+}
+
+// Picks the erase type to use at addr when erasing up to end.  Starting
+// from the largest erase type that is aligned at addr and fits, step down
+// while covering the block with the next smaller type is expected to be
+// faster.  Since erase types nest, doing this block by block gives the
+// plan with the least total expected time.
+static const flash_spi_erase_type_t *plan_erase(nlflash_spi_device_t *dev, uint32_t addr, uint32_t end)
+{
+    unsigned i = dev->num_erase_types - 1;
+    uint32_t best_usec[FLASH_SPI_MAX_ERASE_TYPES];
+    unsigned j;
+
+    while ((i > 0) &&
+           (((addr % dev->erase_types[i].size) != 0) || ((end - addr) < dev->erase_types[i].size)))
+    {
+        i--;
+    }
+
+    // best_usec[j] is the least time to erase an aligned block of dev->erase_types[j].size
+    best_usec[0] = op_time_usec(dev, dev->erase_types[0].op);
+    for (j = 1; j <= i; j++)
+    {
+        uint32_t split_usec = best_usec[j - 1] * (dev->erase_types[j].size / dev->erase_types[j - 1].size);
+        best_usec[j] = MIN(op_time_usec(dev, dev->erase_types[j].op), split_usec);
+    }
+
+    while ((i > 0) && (best_usec[i] < op_time_usec(dev, dev->erase_types[i].op)))
+    {
+        i--;
+    }
+
+    return &dev->erase_types[i];
+}
+
+// expected time to erase an aligned range one block at a time
+static uint32_t plan_erase_time_usec(nlflash_spi_device_t *dev, uint32_t addr, size_t len)
+{
+    uint32_t end = addr + len;
+    uint32_t usec = 0;
+
+    while (addr < end)
+    {
+        const flash_spi_erase_type_t *erase_type = plan_erase(dev, addr, end);
+
+        usec += op_time_usec(dev, erase_type->op);
+        addr += erase_type->size;
+    }
+
+    return usec;
+}
+
+static bool erase_range_is_ok(nlflash_spi_device_t *dev, uint32_t addr, size_t len)
+{
+    return (((addr % dev->info.erase_size) == 0) &&
+            ((len % dev->info.erase_size) == 0) &&
+            (addr + len <= dev->info.size));
+}
+
+#ifdef FLASH_SPI_USE_SFDP
+static uint32_t sfdp_dword(const uint8_t *buf)
+{
+    return (buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24));
+}
+
+// Reads the basic flash parameter table into bfpt, zero filling dwords
+// past its end.  Returns the number of dwords read.
+static int sfdp_read_bfpt(nlflash_spi_device_t *dev, uint32_t *bfpt)
+{
+    int retval;
+    uint8_t header[8];
+    uint8_t param_header[8];
+    uint8_t table[SFDP_BFPT_NUM_DWORDS * sizeof(uint32_t)];
+    unsigned num_dwords;
+    unsigned i;
+
+    retval = spi_cmd_address_data(dev, CMD_RDSFDP, 0, false, header, sizeof(header), SFDP_DUMMY_BYTES);
+    nlREQUIRE(retval >= 0, done);
+    nlREQUIRE_ACTION(sfdp_dword(header) == SFDP_SIGNATURE, done, retval = -ENODEV);
+
+    // the first parameter header is always the basic flash parameter table
+    retval = spi_cmd_address_data(dev, CMD_RDSFDP, SFDP_PARAM_HEADER_ADDR, false, param_header, sizeof(param_header), SFDP_DUMMY_BYTES);
+    nlREQUIRE(retval >= 0, done);
+    nlREQUIRE_ACTION((param_header[0] == SFDP_BFPT_ID_LSB) && (param_header[7] == SFDP_BFPT_ID_MSB), done, retval = -ENODEV);
+
+    num_dwords = MIN(param_header[3], SFDP_BFPT_NUM_DWORDS);
+    retval = spi_cmd_address_data(dev, CMD_RDSFDP, sfdp_dword(&param_header[4]) & 0xFFFFFF, false,
+                                  table, num_dwords * sizeof(uint32_t), SFDP_DUMMY_BYTES);
+    nlREQUIRE(retval >= 0, done);
+
+    memset(bfpt, 0, SFDP_BFPT_NUM_DWORDS * sizeof(uint32_t));
+    for (i = 0; i < num_dwords; i++)
+    {
+        bfpt[i] = sfdp_dword(&table[i * sizeof(uint32_t)]);
+    }
+    retval = num_dwords;
+
+done:
+    return retval;
+}
+
+// Picks the erase commands from BFPT dwords 8 and 9, with typical and max
+// times from dword 10.  Only erase sizes from the part's erase_size to
+// fast_erase_size are used, since that's what the rest of the driver and
+// the partition layout are built around.
+static void sfdp_parse_erase_types(nlflash_spi_device_t *dev, const uint32_t *bfpt, unsigned num_dwords)
+{
+    // typical erase time units in ms, indexed by DWORD10 unit bits
+    static const uint16_t s_erase_unit_ms[] = { 1, 16, 128, 1000 };
+    flash_spi_erase_type_t types[FLASH_SPI_MAX_ERASE_TYPES];
+    uint32_t typ_usec[FLASH_SPI_MAX_ERASE_TYPES];
+    unsigned num_types = 0;
+    unsigned max_multiplier;
+    unsigned i;
+    unsigned j;
+
+    // erase times are only in JESD216A and later
+    if (num_dwords < 10)
+    {
+        return;
+    }
+    max_multiplier = 2 * ((bfpt[9] & 0xF) + 1);
+
+    for (i = 0; i < 4; i++)
+    {
+        uint16_t type = bfpt[7 + (i / 2)] >> (16 * (i % 2));
+        uint8_t size_exp = type & 0xFF;
+        uint32_t time_bits = bfpt[9] >> (4 + 7 * i);
+        uint32_t typ_ms = ((time_bits & 0x1F) + 1) * s_erase_unit_ms[(time_bits >> 5) & 0x3];
+        flash_spi_erase_type_t erase_type;
+
+        if ((size_exp == 0) || (size_exp >= 32) ||
+            ((1UL << size_exp) < dev->info.erase_size) || ((1UL << size_exp) > dev->info.fast_erase_size))
+        {
+            continue;
+        }
+        if (num_types == FLASH_SPI_MAX_ERASE_TYPES)
+        {
+            // more than we have ops for, stick with the part's
+            return;
+        }
+
+        erase_type.size = 1UL << size_exp;
+        erase_type.cmd = type >> 8;
+        erase_type.retry_delay_ms = MAX(typ_ms / 4, 1);
+        erase_type.retry_cnt = (typ_ms * max_multiplier) / erase_type.retry_delay_ms + 1;
+
+        // insert in increasing size
+        for (j = num_types; (j > 0) && (types[j - 1].size > erase_type.size); j--)
+        {
+            types[j] = types[j - 1];
+            typ_usec[j] = typ_usec[j - 1];
+        }
+        types[j] = erase_type;
+        typ_usec[j] = typ_ms * 1000;
+        num_types++;
+    }
+
+    if ((num_types == 0) || (types[0].size != dev->info.erase_size))
+    {
+        return;
+    }
+
+    for (i = 0; i < num_types; i++)
+    {
+        types[i].op = erase_type_op(i, num_types);
+        dev->erase_types[i] = types[i];
+        dev->op_typ_usec[types[i].op] = typ_usec[i];
+    }
+    dev->num_erase_types = num_types;
+}
+
+#if FLASH_SPI_MULTI_LINE && (FLASH_SPI_READ_MODE != FLASH_SPI_READ_MODE_SINGLE)
+// Fills in mode from an SFDP fast read descriptor (dummy clocks in bits
+// 4:0, mode clocks in 7:5 and opcode in 15:8).  Returns false if the
+// dummy clocks don't fit our whole dummy bytes.
+static bool sfdp_parse_read_mode(uint16_t desc, uint8_t addr_lines, uint8_t data_lines, flash_spi_cmd_mode_t *mode)
+{
+    unsigned clocks = (desc & 0x1F) + ((desc >> 5) & 0x7);
+
+    if ((desc >> 8) == 0 || ((clocks * addr_lines) % 8) != 0 ||
+        ((clocks * addr_lines) / 8) > FLASH_SPI_MAX_DUMMY_BYTES)
+    {
+        return false;
+    }
+    mode->cmd = desc >> 8;
+    mode->addr_lines = addr_lines;
+    mode->data_lines = data_lines;
+    mode->dummy_bytes = (clocks * addr_lines) / 8;
+    return true;
+}
+
+// Uses the fastest read the chip supports, up to the FLASH_SPI_READ_MODE
+// the board is wired for, from BFPT dwords 1, 3 and 4.
+static void sfdp_parse_read_modes(nlflash_spi_device_t *dev, const uint32_t *bfpt, unsigned num_dwords)
+{
+    flash_spi_cmd_mode_t mode;
+    bool found = false;
+
+    if (num_dwords < 4)
+    {
+        return;
+    }
+
+#if (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_QUAD_IO)
+    if (!found && (bfpt[0] & (1UL << 21)))
+    {
+        found = sfdp_parse_read_mode(bfpt[2] & 0xFFFF, NLSPI_LINES_QUAD, NLSPI_LINES_QUAD, &mode);
+    }
+#endif
+#if (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_QUAD_IO) || (FLASH_SPI_READ_MODE == FLASH_SPI_READ_MODE_QUAD_OUTPUT)
+    if (!found && (bfpt[0] & (1UL << 22)))
+    {
+        found = sfdp_parse_read_mode(bfpt[2] >> 16, NLSPI_LINES_SINGLE, NLSPI_LINES_QUAD, &mode);
+    }
+#endif
+    if (!found && (bfpt[0] & (1UL << 16)))
+    {
+        found = sfdp_parse_read_mode(bfpt[3] & 0xFFFF, NLSPI_LINES_SINGLE, NLSPI_LINES_DUAL, &mode);
+    }
+
+    if (found)
+    {
+        dev->read_cmd_mode = mode;
+    }
+    else
+    {
+        // the chip doesn't support the wired mode, fall back to single line
+        const flash_spi_cmd_mode_t single_mode = { FLASH_SPI_READ_CMD, NLSPI_LINES_SINGLE, NLSPI_LINES_SINGLE, FLASH_SPI_READ_DUMMY_BYTES };
+
+        dev->read_cmd_mode = single_mode;
+    }
+}
+#endif
+
+// Reads the chip's JEDEC SFDP tables and uses them in place of the part's
+// size, erase commands, read command and typical timings.  Anything the
+// chip doesn't describe, or describes in a way we can't use, keeps the
+// part's value.
+static int sfdp_discover(nlflash_spi_device_t *dev)
+{
+    // typical chip erase time units in ms, indexed by DWORD11 unit bits
+    static const uint32_t s_chip_erase_unit_ms[] = { 16, 256, 4000, 64000 };
+    uint32_t bfpt[SFDP_BFPT_NUM_DWORDS];
+    int retval;
+    unsigned num_dwords;
+
+    retval = sfdp_read_bfpt(dev, bfpt);
+    nlREQUIRE(retval >= 0, done);
+    num_dwords = retval;
+    retval = 0;
+
+    // density in bits, either as size - 1 or as a power of 2
+    if (num_dwords >= 2)
+    {
+        uint64_t size;
+
+        if (bfpt[1] & (1UL << 31))
+        {
+            size = ((bfpt[1] & 0x7FFFFFFF) < 64) ? (1ULL << (bfpt[1] & 0x7FFFFFFF)) / 8 : 0;
+        }
+        else
+        {
+            size = ((uint64_t)bfpt[1] + 1) / 8;
+        }
+        // partitions are laid out for the part's size, so only shrink it
+        if ((size > 0) && (size < dev->chip->info.size))
+        {
+            dev->info.size = size;
+        }
+    }
+
+    sfdp_parse_erase_types(dev, bfpt, num_dwords);
+
+#if FLASH_SPI_MULTI_LINE && (FLASH_SPI_READ_MODE != FLASH_SPI_READ_MODE_SINGLE)
+    sfdp_parse_read_modes(dev, bfpt, num_dwords);
+#endif
+
+    // typical page program and chip erase times
+    if (num_dwords >= 11)
+    {
+        uint32_t pp_bits = bfpt[10] >> 8;
+        uint32_t be_bits = bfpt[10] >> 24;
+
+        dev->op_typ_usec[FLASH_SPI_OP_PP] = ((pp_bits & 0x1F) + 1) * ((pp_bits & 0x20) ? 64 : 8);
+        dev->op_typ_usec[FLASH_SPI_OP_BE] = ((be_bits & 0x1F) + 1) * s_chip_erase_unit_ms[(be_bits >> 5) & 0x3] * 1000;
+    }
+
+done:
+    return retval;
+}
+#endif /* FLASH_SPI_USE_SFDP */
+
+#ifdef FLASH_SPI_USE_CLOCK_CALIBRATION
+int nlflash_spi_clock_cal_load(unsigned device, uint32_t *hz) LINKER_REPLACEABLE_FUNCTION(nlflash_spi_clock_cal_load_default);
+int nlflash_spi_clock_cal_store(unsigned device, uint32_t hz) LINKER_REPLACEABLE_FUNCTION(nlflash_spi_clock_cal_store_default);
+
+/* not static so the compiler doesn't inline them and prevent linker script replacement from working */
+int nlflash_spi_clock_cal_load_default(unsigned device, uint32_t *hz);
+int nlflash_spi_clock_cal_store_default(unsigned device, uint32_t hz);
+
+int nlflash_spi_clock_cal_load_default(unsigned device, uint32_t *hz)
+{
+    return -ENOENT;
+}
+
+int nlflash_spi_clock_cal_store_default(unsigned device, uint32_t hz)
+{
+    return 0;
+}
+
+// Mixes runs of alternating bits with a counter, so both the fastest
+// edges and every byte value get sampled.
+static uint8_t clock_cal_pattern(uint32_t offset)
+{
+    static const uint8_t s_edges[] = { 0x55, 0xAA, 0x00, 0xFF, 0x33, 0xCC, 0x0F, 0xF0 };
+
+    return ((offset / sizeof(s_edges)) & 1) ? (uint8_t)offset : s_edges[offset % sizeof(s_edges)];
+}
+
+// Select hz for the following transfers, and for single line reads the
+// read command that the chip allows at that rate.
+static void clock_cal_apply_hz(nlflash_spi_device_t *dev, uint32_t hz)
+{
+    dev->cal_slave.max_freq_hz = hz;
+    if ((dev->read_cmd_mode.addr_lines != NLSPI_LINES_SINGLE) ||
+        (dev->read_cmd_mode.data_lines != NLSPI_LINES_SINGLE))
+    {
+        return;
+    }
+    if (hz > FLASH_SPI_READ_FREQ_HZ)
+    {
+        dev->read_cmd_mode.cmd = CMD_FAST_READ;
+        dev->read_cmd_mode.dummy_bytes = FLASH_SPI_FAST_READ_DUMMY_CYCLES;
+    }
+    else
+    {
+        dev->read_cmd_mode.cmd = CMD_READ;
+        dev->read_cmd_mode.dummy_bytes = FLASH_SPI_READ_DUMMY_CYCLES;
+    }
+}
+
+// Like clock_cal_apply_hz(), with the device requested.  Without split
+// transactions the controller picks up the clock when the bus is requested.
+static int clock_cal_switch_hz(nlflash_spi_device_t *dev, uint32_t hz)
+{
+    int retval = 0;
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 0)
+    nlspi_release(dev->slave);
+#endif
+    clock_cal_apply_hz(dev, hz);
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 0)
+    retval = nlspi_request(dev->slave);
+#endif
+    return retval;
+}
+
+// CRC of the calibration region as read at the current clock, or of the
+// pattern itself if from_pattern.  *blank is cleared if any byte read
+// isn't erased.
+static int clock_cal_crc(nlflash_spi_device_t *dev, bool from_pattern, unsigned *crc, bool *blank)
+{
+    uint32_t buf[FLASH_SPI_CLOCK_CAL_BUFFER_SIZE / sizeof(uint32_t)];
+    uint32_t offset = 0;
+    int retval = 0;
+
+    *crc = NLCRC_SEED_DEFAULT;
+    while (offset < FLASH_SPI_CLOCK_CAL_SIZE)
+    {
+        size_t chunk = MIN(sizeof(buf), FLASH_SPI_CLOCK_CAL_SIZE - offset);
+
+        if (from_pattern)
+        {
+            for (size_t i = 0; i < chunk; i++)
+            {
+                ((uint8_t *)buf)[i] = clock_cal_pattern(offset + i);
+            }
+        }
+        else
+        {
+            retval = spi_cmd_mode_address_data(dev, &dev->read_cmd_mode, FLASH_SPI_CLOCK_CAL_ADDR + offset,
+                                               false, (uint8_t *)buf, chunk);
+            nlREQUIRE(retval >= 0, done);
+            if ((blank != NULL) && !nlflash_buf_is_blank(buf, chunk))
+            {
+                *blank = false;
+            }
+        }
+        *crc = nlcrc_compute(*crc, (uint8_t *)buf, chunk);
+        offset += chunk;
+    }
+
+done:
+    return retval;
+}
+
+// Program the pattern into the (erased) calibration region.
+static int clock_cal_program(nlflash_spi_device_t *dev)
+{
+    uint32_t buf[FLASH_SPI_CLOCK_CAL_BUFFER_SIZE / sizeof(uint32_t)];
+    uint32_t offset = 0;
+    int retval = 0;
+
+    while (offset < FLASH_SPI_CLOCK_CAL_SIZE)
+    {
+        uint32_t addr = FLASH_SPI_CLOCK_CAL_ADDR + offset;
+        size_t chunk = MIN(sizeof(buf), FLASH_SPI_CLOCK_CAL_SIZE - offset);
+
+        // don't cross a page
+        chunk = MIN(chunk, dev->info.write_size - (addr % dev->info.write_size));
+        for (size_t i = 0; i < chunk; i++)
+        {
+            ((uint8_t *)buf)[i] = clock_cal_pattern(offset + i);
+        }
+        retval = write_internal(dev, addr, chunk, (uint8_t *)buf);
+        nlREQUIRE(retval >= 0, done);
+        offset += chunk;
+    }
+
+done:
+    return retval;
+}
+
+// Returns true if the calibration region reads back as the pattern
+// FLASH_SPI_CLOCK_CAL_PASSES times in a row at hz.
+static bool clock_cal_passes(nlflash_spi_device_t *dev, uint32_t hz, unsigned expected)
+{
+    bool passed = (clock_cal_switch_hz(dev, hz) >= 0);
+
+    for (unsigned pass = 0; passed && (pass < FLASH_SPI_CLOCK_CAL_PASSES); pass++)
+    {
+        unsigned crc;
+
+        passed = (clock_cal_crc(dev, false, &crc, NULL) >= 0) && (crc == expected);
+    }
+    return passed;
+}
+
+// Find the fastest clock at which the calibration region passes, then back
+// off by the margin.  If the board's clock passes, faster rates are tried up
+// to the first failure; otherwise slower ones down to the first pass.
+// Returns 0 if no rate passes.  Called with the device requested and crc
+// hardware held.
+static uint32_t clock_cal_search(nlflash_spi_device_t *dev, uint32_t base_hz, unsigned expected)
+{
+    const uint32_t margin_hz = FLASH_SPI_CLOCK_CAL_MARGIN_STEPS * FLASH_SPI_CLOCK_CAL_STEP_HZ;
+    uint32_t floor_hz = base_hz;
+    uint32_t best_hz = 0;
+    uint32_t hz;
+
+    if (clock_cal_passes(dev, base_hz, expected))
+    {
+        best_hz = base_hz;
+        for (hz = base_hz + FLASH_SPI_CLOCK_CAL_STEP_HZ; hz <= FLASH_SPI_CLOCK_CAL_MAX_HZ; hz += FLASH_SPI_CLOCK_CAL_STEP_HZ)
+        {
+            if (!clock_cal_passes(dev, hz, expected))
+            {
+                break;
+            }
+            best_hz = hz;
+        }
+    }
+    else
+    {
+        // the board's clock is too fast for this part or layout
+        floor_hz = FLASH_SPI_CLOCK_CAL_MIN_HZ;
+        for (hz = base_hz; hz >= FLASH_SPI_CLOCK_CAL_MIN_HZ + FLASH_SPI_CLOCK_CAL_STEP_HZ; )
+        {
+            hz -= FLASH_SPI_CLOCK_CAL_STEP_HZ;
+            if (clock_cal_passes(dev, hz, expected))
+            {
+                best_hz = hz;
+                break;
+            }
+        }
+        if (best_hz == 0)
+        {
+            return 0;
+        }
+    }
+
+    if (best_hz - floor_hz >= margin_hz)
+    {
+        best_hz -= margin_hz;
+    }
+    else
+    {
+        best_hz = floor_hz;
+    }
+    return best_hz;
+}
+
+// Run the device at the stored calibrated clock if the region still reads
+// back at it, or calibrate and store it.  On any failure the device keeps
+// the board's clock and calibrates again next boot.
+static int clock_calibrate(nlflash_spi_device_t *dev)
+{
+    unsigned index = dev - s_flash_spi_devices;
+    uint32_t base_hz = FLASH_SPI_SLAVE(index)->max_freq_hz;
+    uint32_t hz;
+    unsigned expected;
+    unsigned crc;
+    bool blank = true;
+    int retval;
+
+    dev->cal_slave = *FLASH_SPI_SLAVE(index);
+    dev->slave = &dev->cal_slave;
+    clock_cal_apply_hz(dev, base_hz);
+
+    retval = flash_spi_request(dev);
+    if (retval < 0)
+    {
+        return retval;
+    }
+    retval = nlcrc_request(NLCRC_TRANSPOSE_WRITE_DEFAULT, NLCRC_TRANSPOSE_READ_DEFAULT, NLCRC_XOR_ON_READ_DEFAULT,
+                           NLCRC_LEN_DEFAULT, NLCRC_POLY_DEFAULT);
+    nlREQUIRE(retval >= 0, release_device);
+
+    clock_cal_crc(dev, true, &expected, NULL);
+
+    retval = nlflash_spi_clock_cal_load(index, &hz);
+    if ((retval >= 0) && (hz >= FLASH_SPI_CLOCK_CAL_MIN_HZ) && (hz <= FLASH_SPI_CLOCK_CAL_MAX_HZ))
+    {
+        retval = clock_cal_switch_hz(dev, hz);
+        if (retval >= 0)
+        {
+            retval = clock_cal_crc(dev, false, &crc, NULL);
+        }
+        if ((retval >= 0) && (crc == expected))
+        {
+            goto release_crc;
+        }
+        // the part, board or temperature range changed; calibrate again
+    }
+
+    // check and fill in the region at the slowest rate
+    retval = clock_cal_switch_hz(dev, FLASH_SPI_CLOCK_CAL_MIN_HZ);
+    nlREQUIRE(retval >= 0, release_crc);
+    retval = clock_cal_crc(dev, false, &crc, &blank);
+    nlREQUIRE(retval >= 0, release_crc);
+
+    // the product reserves the region; fill it in the first time
+    if ((crc != expected) && blank)
+    {
+        retval = clock_cal_program(dev);
+        nlREQUIRE(retval >= 0, release_crc);
+        retval = clock_cal_crc(dev, false, &crc, NULL);
+        nlREQUIRE(retval >= 0, release_crc);
+    }
+    nlREQUIRE_ACTION(crc == expected, release_crc, retval = -EILSEQ);
+
+    hz = clock_cal_search(dev, base_hz, expected);
+    nlREQUIRE_ACTION(hz != 0, release_crc, retval = -EILSEQ);
+    retval = clock_cal_switch_hz(dev, hz);
+    if (retval >= 0)
+    {
+        retval = nlflash_spi_clock_cal_store(index, hz);
+    }
+
+release_crc:
+    nlcrc_release();
+release_device:
+    if (retval < 0)
+    {
+        clock_cal_switch_hz(dev, base_hz);
+    }
+    flash_spi_release(dev);
+    return retval;
+}
+#endif /* FLASH_SPI_USE_CLOCK_CALIBRATION */
+
+// Starts the device out with its part's geometry, erase types, timings
+// and read and program commands.
+static void use_chip(nlflash_spi_device_t *dev)
+{
+    const nlflash_spi_chip_t *chip = dev->chip;
+    unsigned i;
+
+    nlASSERT((chip->num_erase_cmds > 0) && (chip->num_erase_cmds <= FLASH_SPI_MAX_ERASE_TYPES));
+    nlASSERT(chip->erase_cmds[0].size == chip->info.erase_size);
+    nlASSERT(chip->info.write_size <= FLASH_SPI_MAX_PAGE_SIZE);
+    nlASSERT(chip->info.fast_erase_size / chip->info.erase_size <= FLASH_SPI_MAX_SECTORS_PER_BLOCK);
+
+    dev->info = chip->info;
+    memset(dev->op_typ_usec, 0, sizeof(dev->op_typ_usec));
+    for (i = 0; i < chip->num_erase_cmds; i++)
+    {
+        const nlflash_spi_erase_cmd_t *erase_cmd = &chip->erase_cmds[i];
+        flash_spi_erase_type_t *erase_type = &dev->erase_types[i];
+
+        erase_type->size = erase_cmd->size;
+        erase_type->cmd = erase_cmd->cmd;
+        erase_type->op = erase_type_op(i, chip->num_erase_cmds);
+        erase_type->retry_cnt = erase_cmd->retry_cnt;
+        erase_type->retry_delay_ms = erase_cmd->retry_delay_ms;
+        dev->op_typ_usec[erase_type->op] = erase_cmd->typ_usec;
+    }
+    dev->num_erase_types = chip->num_erase_cmds;
+    dev->op_typ_usec[FLASH_SPI_OP_PP] = chip->pp_typ_usec;
+    dev->op_typ_usec[FLASH_SPI_OP_BE] = chip->be_typ_usec;
+    dev->op_typ_usec[FLASH_SPI_OP_WRSR] = chip->wrsr_typ_usec;
+#ifdef FLASH_SPI_USE_SRAM_BUFFERS
+    dev->op_typ_usec[FLASH_SPI_OP_BUF_PP] = BUF_PP_TYP_USEC;
+    dev->op_typ_usec[FLASH_SPI_OP_BUF_LOAD] = BUF_LOAD_TYP_USEC;
+#endif
+    dev->read_cmd_mode = chip->read_cmd_mode;
+    dev->pp_cmd_mode = chip->pp_cmd_mode;
+}
+
+static int flash_spi_init(nlflash_spi_device_t *dev)
+{
+#ifdef FLASH_SPI_USE_SFDP
+    int retval;
+#endif
+
+    use_chip(dev);
+
+#ifdef FLASH_SPI_USE_SFDP
+    retval = flash_spi_request(dev);
+    if (retval < 0)
+    {
+        return retval;
+    }
+    // without SFDP the part's values are still good for this chip
+    sfdp_discover(dev);
+    flash_spi_release(dev);
+#endif
+#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
+    for (unsigned i = 0; i < FLASH_SPI_NUM_PARTIAL_PAGE_BUFFERS; i++)
+    {
+        memset(dev->page_buffers[i].data, 0xff, sizeof(dev->page_buffers[i].data));
+        dev->page_buffers[i].start = 0;
+        dev->page_buffers[i].end = 0;
+    }
+#endif
+#ifdef FLASH_SPI_USE_ADAPTIVE_BUSY_WAIT
+    memcpy(dev->busy_estimate_usec, dev->op_typ_usec, sizeof(dev->op_typ_usec));
+#endif
+#if FLASH_SPI_POWERDOWN_IDLE_MSEC > 0
+    nl_swtimer_init(&dev->idle_timer, idle_timer_expired, dev);
+#endif
+#ifdef FLASH_SPI_USE_CLOCK_CALIBRATION
+    // the board's clock still works if calibration fails
+    clock_calibrate(dev);
+#endif
+    return 0;
+}
+
+// Reads the block at addr, setting bit n of dirty if the nth
+// erase_size sector in it is not blank.  Returns the number
+// of dirty sectors.
+static int find_dirty_sectors(nlflash_spi_device_t *dev, uint32_t addr, uint32_t size, uint32_t *dirty)
+{
+    int retval = 0;
+    unsigned num_dirty = 0;
+    uint32_t buf[FLASH_SPI_BLANK_CHECK_BUFFER_SIZE / sizeof(uint32_t)];
+    unsigned sector;
+
+    nlASSERT(size / dev->info.erase_size <= FLASH_SPI_MAX_SECTORS_PER_BLOCK);
+
+    memset(dirty, 0, ((size / dev->info.erase_size) + 31) / 32 * sizeof(uint32_t));
+
+    for (sector = 0; sector < size / dev->info.erase_size; sector++)
+    {
+        uint32_t offset = 0;
+
+        while (offset < dev->info.erase_size)
+        {
+            size_t chunk = MIN(sizeof(buf), dev->info.erase_size - offset);
+
+            retval = spi_cmd_mode_address_data(dev, &dev->read_cmd_mode, addr + offset, false, (uint8_t *)buf, chunk);
+            nlREQUIRE(retval >= 0, done);
+
+            if (!nlflash_buf_is_blank(buf, chunk))
+            {
+                dirty[sector / 32] |= (1UL << (sector % 32));
+                num_dirty++;
+                break;
+            }
+            offset += chunk;
+        }
+        addr += dev->info.erase_size;
+    }
+    retval = num_dirty;
+
+done:
+    return retval;
+}
+
+// Erases the planned block at addr, unless it's blank.  If only some
+// of its sectors have data and erasing just those is expected to be
+// quicker, erase them individually.  Adds the number of sectors that
+// didn't need erasing to *skipped.
+static int erase_block_if_dirty(nlflash_spi_device_t *dev, const flash_spi_erase_type_t *erase_type, uint32_t addr, size_t *skipped)
+{
+    const flash_spi_erase_type_t *sector_type = &dev->erase_types[0];
+    unsigned num_sectors = erase_type->size / dev->info.erase_size;
+    unsigned num_dirty;
+    uint32_t dirty[(FLASH_SPI_MAX_SECTORS_PER_BLOCK + 31) / 32];
+    unsigned sector;
+    int retval;
+
+    retval = find_dirty_sectors(dev, addr, erase_type->size, dirty);
+    nlREQUIRE(retval >= 0, done);
+
+    num_dirty = retval;
+
+    if ((num_dirty == num_sectors) ||
+        (num_dirty * op_time_usec(dev, sector_type->op) >=
+         op_time_usec(dev, erase_type->op)))
+    {
+        retval = erase_block(dev, erase_type, addr);
+        goto done;
+    }
+
+    for (sector = 0; sector < num_sectors; sector++)
+    {
+        if (dirty[sector / 32] & (1UL << (sector % 32)))
+        {
+            retval = erase_block(dev, sector_type, addr + sector * dev->info.erase_size);
+            nlREQUIRE(retval >= 0, done);
+        }
+    }
+    *skipped += num_sectors - num_dirty;
+
+done:
+    return retval;
+}
+
+// Erases [addr, addr + len).  If skipped is non-NULL, blocks are read
+// first and blank ones aren't erased, with the number of skipped
+// erase_size sectors returned in *skipped.
+static int erase_range(nlflash_spi_device_t *dev, uint32_t addr, size_t len, size_t *retlen, size_t *skipped, nlloop_callback_fp callback)
+{
+    uint32_t end = addr + len;
+    int retval;
+#ifdef CMD_WREN
+    const uint8_t wren[1] = {CMD_WREN};
+#endif
+
+    *retlen = 0;
+
+    if (!erase_range_is_ok(dev, addr, len))
+    {
+        return -EINVAL;
+    }
+
+    retval = flash_spi_request(dev);
+    nlREQUIRE(retval >= 0, done);
+
+    power_mode_update(dev, len);
+
+    // Check for bulk erase first, if it's expected to be quicker than
+    // erasing the chip block by block.  With blank checking, erasing block
+    // by block lets us skip the blank ones.
+    if ((skipped == NULL) && (addr == 0) && (len == dev->info.size) &&
+        (op_time_usec(dev, FLASH_SPI_OP_BE) <= plan_erase_time_usec(dev, addr, len)))
+    {
+        // erase the entire chip
+#if CMD_BE_ADDR
+        retval = spi_cmd_address_data(dev, CMD_BE, CMD_BE_ADDR, true, NULL, 0, 0);
+#else
+        nlspi_transfer_t xfer;
+        uint8_t cmd = CMD_BE;
+
+        xfer.tx = &cmd;
+        xfer.rx = NULL;
+        xfer.num = sizeof(cmd);
+        xfer.callback = NULL;
+
+        retval = nlspi_write(dev->slave, wren, sizeof(wren));
+        nlREQUIRE(retval >= 0, done);
+
+        retval  = nlspi_transfer(dev->slave, &xfer, 1);
+#endif
+        nlREQUIRE(retval >= 0, done);
+        retval = wait_until_not_busy(dev, FLASH_SPI_OP_BE, BE_DELAY_LOOP_COUNT, BE_DELAY_MSEC);
+        if (retval >= 0) {
+            *retlen = dev->info.size;
+        }
+        goto done;
+    }
+
+    while (addr < end)
+    {
+        const flash_spi_erase_type_t *erase_type = plan_erase(dev, addr, end);
+
+        if (skipped != NULL)
+        {
+            retval = erase_block_if_dirty(dev, erase_type, addr, skipped);
+        }
+        else
+        {
+            retval = erase_block(dev, erase_type, addr);
+        }
+        nlREQUIRE(retval >= 0, done);
+
+        addr += erase_type->size;
+        *retlen += erase_type->size;
+
+        if (callback != NULL)
+        {
+            retval = callback();
+            nlREQUIRE(retval >= 0, done);
+        }
+    }
+
+done:
+    flash_spi_release(dev);
+    return retval;
+}
+
+static int flash_spi_erase(nlflash_spi_device_t *dev, uint32_t addr, size_t len, size_t *retlen, nlloop_callback_fp callback)
+{
+    return erase_range(dev, addr, len, retlen, NULL, callback);
+}
+
+static int flash_spi_erase_blank_check(nlflash_spi_device_t *dev, uint32_t addr, size_t len, size_t *retlen, size_t *skipped, nlloop_callback_fp callback)
+{
+    *skipped = 0;
+    return erase_range(dev, addr, len, retlen, skipped, callback);
+}
+
+static int flash_spi_get_erase_time(nlflash_spi_device_t *dev, uint32_t addr, size_t len, uint32_t *usec)
+{
+    uint32_t block_usec;
+
+    if (!erase_range_is_ok(dev, addr, len))
+    {
+        return -EINVAL;
+    }
+
+    block_usec = plan_erase_time_usec(dev, addr, len);
+    if ((addr == 0) && (len == dev->info.size))
+    {
+        *usec = MIN(op_time_usec(dev, FLASH_SPI_OP_BE), block_usec);
+    }
+    else
+    {
+        *usec = block_usec;
+    }
+
+    return 0;
+}
+
+static int flash_spi_read(nlflash_spi_device_t *dev, uint32_t addr, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback)
+{
+    int retval;
+
+    *retlen = 0;
+
+    retval = flash_spi_request(dev);
+    nlREQUIRE(retval >= 0, done);
+
+    power_mode_update(dev, len);
+    retval = spi_cmd_mode_address_data(dev, &dev->read_cmd_mode, addr, false, buf, len);
+    nlREQUIRE(retval >= 0, done);
+    *retlen = len;
+
+done:
+    flash_spi_release(dev);
+    return retval;
+}
+
+// Called without the flash lock held.  If another task is waiting on a
+// program or erase that doesn't overlap [addr, addr + len), that task
+// suspends the op, does the read, and resumes the op, so the caller
+// doesn't wait for the whole op.  Returns -EAGAIN if there's nothing to
+// preempt, in which case the caller should take the lock and read normally.
+static int flash_spi_read_preempt(nlflash_spi_device_t *dev, uint32_t addr, size_t len, size_t *retlen, uint8_t *buf)
+{
+#ifdef FLASH_SPI_USE_SUSPEND
+    flash_spi_preempt_t preempt;
+    bool posted = false;
+
+    *retlen = 0;
+
+#if FLASH_SPI_SUSPEND_MIN_PRIORITY > 0
+    if (uxTaskPriorityGet(NULL) < FLASH_SPI_SUSPEND_MIN_PRIORITY)
+    {
+        return -EAGAIN;
+    }
+#endif
+
+    preempt.addr = addr;
+    preempt.len = len;
+    preempt.buf = buf;
+    preempt.task = xTaskGetCurrentTaskHandle();
+    preempt.result = -EINPROGRESS;
+
+    nlplatform_interrupt_disable();
+    if (dev->suspendable && (dev->preempt == NULL) &&
+        ((addr + len <= dev->busy_addr) ||
+         (addr >= dev->busy_addr + dev->busy_len)))
+    {
+        dev->preempt = &preempt;
+        posted = true;
+    }
+    nlplatform_interrupt_enable();
+
+    if (!posted)
+    {
+        return -EAGAIN;
+    }
+
+    // other notifications to this task may wake us early.  the read is
+    // always served, at the latest when the op ends.
+    while (preempt.result == -EINPROGRESS)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+
+    if (preempt.result >= 0)
+    {
+        *retlen = len;
+    }
+    return preempt.result;
+#else /* !defined(FLASH_SPI_USE_SUSPEND) */
+    *retlen = 0;
+    return -EAGAIN;
+#endif /* defined(FLASH_SPI_USE_SUSPEND) */
+}
+
+#ifdef FLASH_SPI_USE_ASYNC_READ
+// The device's read command if it's single line, else the single line
+// read for the device's clock.
+static flash_spi_cmd_mode_t single_line_read_mode(nlflash_spi_device_t *dev)
+{
+    flash_spi_cmd_mode_t mode = { FLASH_SPI_READ_CMD, NLSPI_LINES_SINGLE, NLSPI_LINES_SINGLE, FLASH_SPI_READ_DUMMY_BYTES };
+
+    if ((dev->read_cmd_mode.addr_lines == NLSPI_LINES_SINGLE) &&
+        (dev->read_cmd_mode.data_lines == NLSPI_LINES_SINGLE))
+    {
+        return dev->read_cmd_mode;
+    }
+#ifdef FLASH_SPI_USE_CLOCK_CALIBRATION
+    if (dev->cal_slave.max_freq_hz > FLASH_SPI_READ_FREQ_HZ)
+    {
+        mode.cmd = CMD_FAST_READ;
+        mode.dummy_bytes = FLASH_SPI_FAST_READ_DUMMY_CYCLES;
+    }
+    else
+    {
+        mode.cmd = CMD_READ;
+        mode.dummy_bytes = FLASH_SPI_READ_DUMMY_CYCLES;
+    }
+#endif
+    return mode;
+}
+
+static void read_async_done(const nlspi_slave_t *slave, int result)
+{
+    nlflash_spi_device_t *dev = &s_flash_spi_devices[0];
+    unsigned i;
+
+    for (i = 1; i < FLASH_SPI_NUM_DEVICES; i++)
+    {
+        if (s_flash_spi_devices[i].slave == slave)
+        {
+            dev = &s_flash_spi_devices[i];
+        }
+    }
+
+    dev->async_result = result;
+    dev->async_callback(result, dev->async_context);
+}
+#endif
+
+// Queues the cmd+addr and the data phase as one CS assertion and returns
+// while the data is streamed into buf.  The flash stays powered (and with
+// FLASH_SPI_SPLIT_TRANSACTIONS, the spi controller stays requested) until
+// nlflash_spi_read_async_finish().
+static int flash_spi_read_async(nlflash_spi_device_t *dev, uint32_t addr, size_t len, uint8_t *buf, nlflash_async_handler_t callback, void *context)
+{
+#ifdef FLASH_SPI_USE_ASYNC_READ
+    int retval;
+    nlspi_transfer_t *xfers = dev->async_xfers;
+    flash_spi_cmd_mode_t mode;
+
+    retval = flash_spi_request(dev);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    power_mode_update(dev, len);
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    nlREQUIRE(retval >= 0, release_device);
+#endif
+
+    // abort if FLASH chip is busy
+    retval = flash_is_busy(dev);
+    nlREQUIRE(retval >= 0, release_controller);
+
+    // async reads are always single line since nlspi_transfer_async()
+    // has no multi-line variant
+    mode = single_line_read_mode(dev);
+    fill_cmd_address(dev->async_cmd, mode.cmd, addr);
+    memset(&dev->async_cmd[FLASH_SPI_CMD_ADDR_SIZE], 0xff, mode.dummy_bytes);
+    xfers[0].tx = dev->async_cmd;
+    xfers[0].rx = NULL;
+    xfers[0].num = FLASH_SPI_CMD_ADDR_SIZE + mode.dummy_bytes;
+    xfers[0].callback = NULL;
+    xfers[1].tx = NULL;
+    xfers[1].rx = buf;
+    xfers[1].num = len;
+    xfers[1].callback = NULL;
+
+    dev->async_callback = callback;
+    dev->async_context = context;
+    dev->async_result = -EINPROGRESS;
+
+    retval = nlspi_transfer_async(dev->slave, xfers, 2, read_async_done);
+    nlREQUIRE(retval >= 0, release_controller);
+
+    return retval;
+
+release_controller:
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+release_device:
+#endif
+    flash_spi_release(dev);
+    return retval;
+#else /* !defined(FLASH_SPI_USE_ASYNC_READ) */
+    return -ENOTSUP;
+#endif /* defined(FLASH_SPI_USE_ASYNC_READ) */
+}
+
+static int flash_spi_read_async_finish(nlflash_spi_device_t *dev)
+{
+#ifdef FLASH_SPI_USE_ASYNC_READ
+    int retval = dev->async_result;
+
+    // must not be called until the completion callback has been invoked
+    nlASSERT(retval != -EINPROGRESS);
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+#endif
+    flash_spi_release(dev);
+    return retval;
+#else /* !defined(FLASH_SPI_USE_ASYNC_READ) */
+    return -ENOTSUP;
+#endif /* defined(FLASH_SPI_USE_ASYNC_READ) */
+}
+
+#ifdef FLASH_SPI_USE_SRAM_BUFFERS
+// Write len bytes at offset into one of the SRAM buffers.  Unlike other
+// commands this doesn't check for busy, since the chip takes buffer writes
+// while it commits the other buffer.
+static int sram_write(nlflash_spi_device_t *dev, uint8_t cmd, uint32_t offset, const uint8_t *buf, size_t len)
+{
+    int retval;
+    nlspi_transfer_t xfers[2];
+    uint8_t cmd_buf[FLASH_SPI_CMD_ADDR_SIZE];
+
+#ifdef FLASH_SPI_USE_READ_SESSION
+    if (dev->session_open)
+    {
+        return -EBUSY;
+    }
+#endif
+
+    // buffer addresses are a page offset in page 0
+    fill_cmd_address(cmd_buf, cmd, offset);
+
+    xfers[0].tx = cmd_buf;
+    xfers[0].rx = NULL;
+    xfers[0].num = sizeof(cmd_buf);
+    xfers[0].callback = NULL;
+    xfers[1].tx = buf;
+    xfers[1].rx = NULL;
+    xfers[1].num = len;
+    xfers[1].callback = NULL;
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    if (retval < 0)
+        return retval;
+#endif
+
+    retval = nlspi_transfer(dev->slave, xfers, ARRAY_SIZE(xfers));
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+#endif
+    return retval;
+}
+
+// wait for the last buffer commit to complete
+static int sram_wait(nlflash_spi_device_t *dev)
+{
+    int retval = 0;
+
+    if (dev->sram_busy)
+    {
+        retval = wait_until_not_busy(dev, FLASH_SPI_OP_BUF_PP, BUF_PP_DELAY_LOOP_COUNT, BUF_PP_DELAY_MSEC);
+        dev->sram_busy = false;
+    }
+    return retval;
+}
+
+// Load up to a page at addr into the next SRAM buffer and start committing
+// it to main memory, without waiting for the commit.  The load overlaps the
+// commit of the other buffer, if there is one.
+static int sram_program(nlflash_spi_device_t *dev, uint32_t addr, size_t len, const uint8_t *buf)
+{
+    const flash_spi_sram_buffer_t *sram = &s_sram_buffers[dev->sram_next];
+    uint32_t page_addr = ROUNDDOWN(addr, dev->info.write_size);
+    uint32_t offset = addr - page_addr;
+    flash_spi_cmd_mode_t mode = { 0, NLSPI_LINES_SINGLE, NLSPI_LINES_SINGLE, 0 };
+    int retval;
+
+    nlASSERT(offset + len <= dev->info.write_size);
+
+    if (len < dev->info.write_size)
+    {
+        // the commit erases the whole page, so start from what's there.
+        // the chip can't load a page while committing.
+        retval = sram_wait(dev);
+        nlREQUIRE(retval >= 0, done);
+
+        mode.cmd = sram->load_cmd;
+        retval = spi_cmd_mode_address_data(dev, &mode, page_addr, false, NULL, 0);
+        nlREQUIRE(retval >= 0, done);
+
+        retval = wait_until_not_busy(dev, FLASH_SPI_OP_BUF_LOAD, BUF_LOAD_DELAY_LOOP_COUNT, BUF_LOAD_DELAY_MSEC);
+        nlREQUIRE(retval >= 0, done);
+    }
+
+    retval = sram_write(dev, sram->write_cmd, offset, buf, len);
+    nlREQUIRE(retval >= 0, done);
+
+    retval = sram_wait(dev);
+    nlREQUIRE(retval >= 0, done);
+
+    mode.cmd = sram->commit_cmd;
+    retval = spi_cmd_mode_address_data(dev, &mode, page_addr, false, NULL, 0);
+    nlREQUIRE(retval >= 0, done);
+
+    dev->sram_busy = true;
+    dev->sram_next ^= 1;
+done:
+    return retval;
+}
+#endif /* FLASH_SPI_USE_SRAM_BUFFERS */
+
+// Start programming up to a page at addr.  Returns 1 if the chip is now
+// busy and program_wait() must be called, 0 if there was nothing to program.
+static int program_start(nlflash_spi_device_t *dev, uint32_t addr, size_t len, const uint8_t *buf)
+{
+    int retval;
+
+    power_mode_update(dev, len);
+
+#ifdef FLASH_SPI_USE_SRAM_BUFFERS
+    // every byte of the page is committed, so there's nothing to trim
+    retval = sram_program(dev, addr, len, buf);
+    nlREQUIRE(retval >= 0, done);
+#else /* !defined(FLASH_SPI_USE_SRAM_BUFFERS) */
+#ifdef FLASH_SPI_USE_SPARSE_WRITE
+    // programming 0xFF leaves a byte unchanged, so don't send leading or
+    // trailing runs of it, nor the page at all if that's all there is
+    while ((len > 0) && (buf[0] == 0xFF))
+    {
+        addr++;
+        buf++;
+        len--;
+    }
+    while ((len > 0) && (buf[len - 1] == 0xFF))
+    {
+        len--;
+    }
+    if (len == 0)
+    {
+        return 0;
+    }
+#endif
+
+    retval = spi_cmd_mode_address_data(dev, &dev->pp_cmd_mode, addr, true, (uint8_t *)buf, len);
+    nlREQUIRE(retval >= 0, done);
+#endif /* defined(FLASH_SPI_USE_SRAM_BUFFERS) */
+
+    retval = 1;
+done:
+    return retval;
+}
+
+#ifdef FLASH_SPI_USE_WRITE_VERIFY
+// Read back [addr, addr + len) of a just programmed page while buf is still
+// at hand, rather than have callers re-read the whole partition afterwards.
+// A failure is recorded against the start of the page.
+static int verify_page(nlflash_spi_device_t *dev, uint32_t addr, size_t len, const uint8_t *buf)
+{
+    uint8_t readback[FLASH_SPI_VERIFY_BUFFER_SIZE];
+    size_t offset = 0;
+    int retval = 0;
+
+    while (offset < len)
+    {
+        size_t chunk = MIN(sizeof(readback), len - offset);
+
+        retval = spi_cmd_mode_address_data(dev, &dev->read_cmd_mode, addr + offset, false, readback, chunk);
+        nlREQUIRE(retval >= 0, done);
+
+        if (memcmp(readback, buf + offset, chunk) != 0)
+        {
+            dev->verify_fail_addr = ROUNDDOWN(addr, dev->info.write_size);
+            dev->verify_failed = true;
+            retval = -EIO;
+            goto done;
+        }
+        offset += chunk;
+    }
+
+done:
+    return retval;
+}
+#endif
+
+// Wait for the program of [addr, addr + len) to finish.
+static int program_wait_busy(nlflash_spi_device_t *dev, uint32_t addr, size_t len)
+{
+    int retval;
+
+    start_suspendable(dev, addr, len);
+#ifdef FLASH_SPI_USE_SRAM_BUFFERS
+    retval = sram_wait(dev);
+#else
+    retval = wait_until_not_busy(dev, FLASH_SPI_OP_PP, PP_DELAY_LOOP_COUNT, PP_DELAY_MSEC);
+#endif
+    end_suspendable(dev);
+
+    return retval;
+}
+
+// Wait for the program of buf started by program_start() at [addr, addr + len).
+static int program_wait(nlflash_spi_device_t *dev, uint32_t addr, size_t len, const uint8_t *buf)
+{
+    int retval;
+
+    retval = program_wait_busy(dev, addr, len);
+
+#ifdef FLASH_SPI_USE_WRITE_VERIFY
+    if (retval >= 0)
+    {
+        retval = verify_page(dev, addr, len, buf);
+    }
+#endif
+
+    return retval;
+}
+
+static int write_internal(nlflash_spi_device_t *dev, uint32_t addr, size_t len, const uint8_t *buf)
+{
+    int retval;
+
+    retval = program_start(dev, addr, len, buf);
+    if (retval > 0)
+    {
+        retval = program_wait(dev, addr, len, buf);
+    }
+    return retval;
+}
+
+#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
+static flash_spi_page_buffer_t *page_buffer_find(nlflash_spi_device_t *dev, uint32_t page_addr)
+{
+    for (unsigned i = 0; i < FLASH_SPI_NUM_PARTIAL_PAGE_BUFFERS; i++)
+    {
+        flash_spi_page_buffer_t *pb = &dev->page_buffers[i];
+
+        if ((pb->end != 0) && (pb->page_addr == page_addr))
+        {
+            return pb;
+        }
+    }
+    return NULL;
+}
+
+static int page_buffer_flush(nlflash_spi_device_t *dev, flash_spi_page_buffer_t *pb)
+{
+    int retval = 0;
+
+    if (pb->end != 0)
+    {
+        retval = write_internal(dev, pb->page_addr + pb->start, pb->end - pb->start, pb->data + pb->start);
+
+        // on failure keep the data so a later flush can retry
+        if (retval >= 0)
+        {
+            memset(pb->data, 0xff, sizeof(pb->data));
+            pb->start = 0;
+            pb->end = 0;
+        }
+    }
+    return retval;
+}
+
+// Get a free buffer for page_addr, programming the least recently written
+// page if they're all in use.
+static int page_buffer_alloc(nlflash_spi_device_t *dev, uint32_t page_addr, flash_spi_page_buffer_t **pb_out)
+{
+    flash_spi_page_buffer_t *pb = &dev->page_buffers[0];
+    int retval = 0;
+
+    for (unsigned i = 0; i < FLASH_SPI_NUM_PARTIAL_PAGE_BUFFERS; i++)
+    {
+        flash_spi_page_buffer_t *candidate = &dev->page_buffers[i];
+
+        if (candidate->end == 0)
+        {
+            pb = candidate;
+            break;
+        }
+        if ((int32_t)(candidate->last_use - pb->last_use) < 0)
+        {
+            pb = candidate;
+        }
+    }
+
+    retval = page_buffer_flush(dev, pb);
+    nlREQUIRE(retval >= 0, done);
+
+    pb->page_addr = page_addr;
+    *pb_out = pb;
+
+done:
+    return retval;
+}
+
+// Like programming, the merged data is the AND of the old and new data.
+static void page_buffer_merge(nlflash_spi_device_t *dev, flash_spi_page_buffer_t *pb, size_t offset,
+                              const uint8_t *buf, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        pb->data[offset + i] &= buf[i];
+    }
+
+    if (pb->end == 0)
+    {
+        pb->start = offset;
+        pb->end = offset + len;
+    }
+    else
+    {
+        pb->start = MIN(pb->start, offset);
+        pb->end = MAX(pb->end, offset + len);
+    }
+
+    pb->last_use = ++dev->page_buffer_clock;
+}
+#endif /* FLASH_SPI_USE_PARTIAL_PAGE_BUFFER */
+
+static int flash_spi_write(nlflash_spi_device_t *dev, uint32_t addr, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback)
+{
+#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
+    uint32_t address = addr;
+    const uint8_t *buffer = buf;
+    size_t length = len;
+    size_t written = 0;
+    int retval = 0;
+
+    while ((retval >= 0) && (length > 0))
+    {
+        uint32_t page_addr = ROUNDDOWN(address, dev->info.write_size);
+        size_t offset = address - page_addr;
+        size_t stride = MIN(dev->info.write_size - offset, length);
+        flash_spi_page_buffer_t *pb = page_buffer_find(dev, page_addr);
+
+        if ((pb == NULL) && (stride == dev->info.write_size))
+        {
+            // Nothing cached for a whole page, write the data to flash.
+            retval = write_internal(dev, address, stride, buffer);
+        }
+        else
+        {
+            // Cache the data.  Once data reaches the end of the page,
+            // nothing appending to it will follow, so write the page.
+            if (pb == NULL)
+            {
+                retval = page_buffer_alloc(dev, page_addr, &pb);
+            }
+
+            if (retval >= 0)
+            {
+                page_buffer_merge(dev, pb, offset, buffer, stride);
+
+                if (pb->end == dev->info.write_size)
+                {
+                    retval = page_buffer_flush(dev, pb);
+                }
+            }
+        }
+
+        if (retval >= 0)
+        {
+            address += stride;
+            buffer += stride;
+            length -= stride;
+            written += stride;
+        }
+    }
+
+    if (retlen != NULL)
+    {
+        *retlen = written;
+    }
+
+    return retval;
+#else /* !defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
+    int retval;
+    *retlen = 0;
+
+    retval = flash_spi_request(dev);
+    nlREQUIRE(retval >= 0, done);
+
+    uint32_t offsetInPage = addr % dev->info.write_size;
+
+    // write any leading partial pages that don't start on page boundary
+    if (offsetInPage)
+    {
+        int partial_page_size;
+        if (offsetInPage + len > dev->info.write_size) {
+            partial_page_size = dev->info.write_size - offsetInPage;
+        } else {
+            partial_page_size = len;
+        }
+        retval = write_internal(dev, addr, partial_page_size, buf);
+        if (retval == 0) {
+            *retlen += partial_page_size;
+            if (partial_page_size == len) {
+                // we wrote it all requested, we're done
+                goto done;
+            }
+        } else {
+            goto done;
+        }
+        len -= partial_page_size;
+        buf += partial_page_size;
+        addr += partial_page_size;
+    }
+    // write any whole pages
+    while (len >= dev->info.write_size) {
+#if defined(FLASH_SPI_USE_SRAM_BUFFERS) && !defined(FLASH_SPI_USE_WRITE_VERIFY)
+        // load each page while the previous one commits.  verifying
+        // needs each commit to complete before moving on.
+        retval = sram_program(dev, addr, dev->info.write_size, buf);
+#else
+        retval = write_internal(dev, addr, dev->info.write_size, buf);
+#endif
+        if (retval < 0)
+            break;
+        len -= dev->info.write_size;
+        addr += dev->info.write_size;
+        buf += dev->info.write_size;
+        *retlen += dev->info.write_size;
+    }
+#if defined(FLASH_SPI_USE_SRAM_BUFFERS) && !defined(FLASH_SPI_USE_WRITE_VERIFY)
+    {
+        int wait_retval = sram_wait(dev);
+
+        if (retval >= 0) {
+            retval = wait_retval;
+        }
+    }
+#endif
+    // write any trailing partial pages
+    if ((retval == 0) && (len > 0)) {
+        retval = write_internal(dev, addr, len, buf);
+        if (retval == 0) {
+            *retlen += len;
+        }
+    }
+
+done:
+    flash_spi_release(dev);
+    return retval;
+#endif /* defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
+}
+
+// Write out the cached pages that overlap [addr, addr + len), oldest first.
+static int flash_spi_flush_range(nlflash_spi_device_t *dev, uint32_t addr, size_t len)
+{
+#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
+
+    int retval = 0;
+
+    while (retval >= 0)
+    {
+        flash_spi_page_buffer_t *oldest = NULL;
+
+        for (unsigned i = 0; i < FLASH_SPI_NUM_PARTIAL_PAGE_BUFFERS; i++)
+        {
+            flash_spi_page_buffer_t *pb = &dev->page_buffers[i];
+
+            if ((pb->end != 0) &&
+                (pb->page_addr + pb->end > addr) &&
+                (pb->page_addr + pb->start < addr + len) &&
+                ((oldest == NULL) || ((int32_t)(pb->last_use - oldest->last_use) < 0)))
+            {
+                oldest = pb;
+            }
+        }
+
+        if (oldest == NULL)
+        {
+            break;
+        }
+
+        retval = page_buffer_flush(dev, oldest);
+    }
+    return retval;
+
+#else /* !defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
+
+    return 0;
+
+#endif /* defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
+}
+
+static int flash_spi_flush(nlflash_spi_device_t *dev)
+{
+    return flash_spi_flush_range(dev, 0, dev->info.size);
+}
+
+static int flash_spi_write_stream(nlflash_spi_device_t *dev, uint32_t addr, size_t len, size_t *retlen,
+                                  nlflash_write_producer_t producer, void *context)
+{
+#ifdef FLASH_SPI_USE_WRITE_STREAM
+    uint8_t *page = dev->stream_pages[0];
+    size_t requested = 0;
+    int filled;
+    int retval;
+
+    *retlen = 0;
+
+    // anything still cached for the range must be programmed first
+    retval = flash_spi_flush_range(dev, addr, len);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    retval = flash_spi_request(dev);
+    nlREQUIRE(retval >= 0, done);
+
+    // Fill one page while the other programs, so the next program can
+    // start as soon as the chip is ready.  Each fill stops at a page
+    // boundary so only the first and last pages can be partial.
+    requested = MIN(dev->info.write_size - (addr % dev->info.write_size), len);
+    filled = producer(page, requested, context);
+
+    while (filled > 0)
+    {
+        uint32_t program_addr = addr + *retlen;
+        uint8_t *next_page;
+        int next_filled = 0;
+        int busy;
+
+        nlREQUIRE_ACTION((size_t)filled <= requested, done, retval = -EINVAL);
+
+        busy = program_start(dev, program_addr, filled, page);
+        nlREQUIRE_ACTION(busy >= 0, done, retval = busy);
+
+        next_page = (page == dev->stream_pages[0]) ? dev->stream_pages[1] : dev->stream_pages[0];
+        requested = MIN(dev->info.write_size - ((program_addr + filled) % dev->info.write_size),
+                        len - *retlen - filled);
+        if (requested > 0)
+        {
+            next_filled = producer(next_page, requested, context);
+        }
+
+        if (busy)
+        {
+            retval = program_wait(dev, program_addr, filled, page);
+            nlREQUIRE(retval >= 0, done);
+        }
+        *retlen += filled;
+
+        page = next_page;
+        filled = next_filled;
+    }
+
+    if (filled < 0)
+    {
+        retval = filled;
+    }
+
+done:
+    flash_spi_release(dev);
+    return retval;
+#else /* !defined(FLASH_SPI_USE_WRITE_STREAM) */
+    return -ENOTSUP;
+#endif /* defined(FLASH_SPI_USE_WRITE_STREAM) */
+}
+
+// Start programming [addr, addr + len), which must be within a page, and
+// return without waiting for it, so the caller can start programs on other
+// devices meanwhile.  The device stays requested and buf must stay valid
+// until flash_spi_write_finish(), which waits and returns the result.
+static int flash_spi_write_start(nlflash_spi_device_t *dev, uint32_t addr, size_t len, const uint8_t *buf)
+{
+    int retval;
+
+    nlASSERT(!dev->write_pending);
+    nlASSERT((addr % dev->info.write_size) + len <= dev->info.write_size);
+
+    // anything still cached for the page must be programmed first
+    retval = flash_spi_flush_range(dev, addr, len);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    retval = flash_spi_request(dev);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    retval = program_start(dev, addr, len, buf);
+    if (retval < 0)
+    {
+        flash_spi_release(dev);
+        return retval;
+    }
+
+    dev->write_addr = addr;
+    dev->write_len = len;
+    dev->write_buf = buf;
+    dev->write_busy = (retval > 0);
+    dev->write_pending = true;
+    return 0;
+}
+
+static int flash_spi_write_finish(nlflash_spi_device_t *dev)
+{
+    int retval = 0;
+
+    nlASSERT(dev->write_pending);
+
+    if (dev->write_busy)
+    {
+        retval = program_wait(dev, dev->write_addr, dev->write_len, dev->write_buf);
+    }
+    dev->write_pending = false;
+    flash_spi_release(dev);
+    return retval;
+}
 
-static int erase_sector(uint32_t addr, bool isSubSector)
+// Start erasing [addr, addr + len), which must be one aligned block of one
+// of the erase types, and return without waiting for it, so the caller can
+// start erases on other devices meanwhile.  The device stays requested
+// until flash_spi_erase_finish(), which waits and returns the result.
+static int flash_spi_erase_start(nlflash_spi_device_t *dev, uint32_t addr, size_t len)
 {
+    const flash_spi_erase_type_t *erase_type = NULL;
     int retval;
-    uint8_t cmd;
-    uint32_t retry_cnt;
-    uint32_t retry_delay_ms;
 
-    if (isSubSector)
+    nlASSERT(dev->erase_pending == NULL);
+
+    for (unsigned i = 0; i < dev->num_erase_types; i++)
     {
-        cmd = CMD_SSE;
-        retry_cnt = SSE_DELAY_LOOP_COUNT;
-        retry_delay_ms = SSE_DELAY_MSEC;
+        if (dev->erase_types[i].size == len)
+        {
+            erase_type = &dev->erase_types[i];
+        }
     }
-    else
+    if ((erase_type == NULL) || ((addr % len) != 0) || (addr + len > dev->info.size))
     {
-        cmd = CMD_SE;
-        retry_cnt = SE_DELAY_LOOP_COUNT;
-        retry_delay_ms = SE_DELAY_MSEC;
+        return -EINVAL;
     }
 
-    retval = spi_cmd_address_data(cmd, addr, true, NULL, 0, 0);
-    nlREQUIRE(retval >= 0, err_path);
+    retval = flash_spi_request(dev);
+    if (retval < 0)
+    {
+        return retval;
+    }
 
-    retval = wait_until_not_busy(retry_cnt, retry_delay_ms);
+    power_mode_update(dev, len);
 
-err_path:
-    return retval;
-}
+    retval = spi_cmd_address_data(dev, erase_type->cmd, addr, true, NULL, 0, 0);
+    if (retval < 0)
+    {
+        flash_spi_release(dev);
+        return retval;
+    }
 
-int nlflash_spi_init(void)
-{
-#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
-    memset(flash_spi_device.partial_page, 0xff, sizeof(flash_spi_device.partial_page));
-#endif
+    dev->erase_addr = addr;
+    dev->erase_pending = erase_type;
     return 0;
 }
 
-int nlflash_spi_erase(uint32_t addr, size_t len, size_t *retlen, nlloop_callback_fp callback)
+static int flash_spi_erase_finish(nlflash_spi_device_t *dev)
 {
-    uint32_t num_sub_sectors_beg = 0;
-    uint32_t num_sectors = 0;
-    uint32_t num_sub_sectors_end = 0;
-    uint32_t i;
     int retval;
-#ifdef CMD_WREN
-    const uint8_t wren[1] = {CMD_WREN};
-#endif
 
-    retval = nlflash_spi_request();
-    nlREQUIRE(retval >= 0, done);
+    nlASSERT(dev->erase_pending != NULL);
+
+    retval = erase_block_wait(dev, dev->erase_pending, dev->erase_addr);
+    dev->erase_pending = NULL;
+    flash_spi_release(dev);
+    return retval;
+}
+
+static size_t iov_total(const nlflash_iovec_t *iov, unsigned iovcnt)
+{
+    size_t total = 0;
 
-    // Check for bulk erase first
-    if ((addr == 0) && (len == FLASH_SPI_SIZE))
+    for (unsigned i = 0; i < iovcnt; i++)
     {
-        // erase the entire chip
-#if CMD_BE_ADDR
-        retval = spi_cmd_address_data(CMD_BE, CMD_BE_ADDR, true, NULL, 0, 0);
-#else
-        nlspi_transfer_t xfer;
-        uint8_t cmd = CMD_BE;
+        total += iov[i].len;
+    }
+    return total;
+}
 
-        xfer.tx = &cmd;
-        xfer.rx = NULL;
-        xfer.num = sizeof(cmd);
-        xfer.callback = NULL;
+// Read up to FLASH_SPI_MAX_IOVECS buffers with each read command.
+static int flash_spi_readv(nlflash_spi_device_t *dev, uint32_t addr, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen)
+{
+    int retval;
 
-        retval = nlspi_write(&g_flash_spi_slave, wren, sizeof(wren));
-        nlREQUIRE(retval >= 0, done);
+    *retlen = 0;
 
-        retval  = nlspi_transfer(&g_flash_spi_slave, &xfer, 1);
-#endif
-        nlREQUIRE(retval >= 0, done);
-        retval = wait_until_not_busy(BE_DELAY_LOOP_COUNT, BE_DELAY_MSEC);
-        if (retval >= 0) {
-            *retlen = FLASH_SPI_SIZE;
-        }
-        goto done;
-    }
+    retval = flash_spi_request(dev);
+    nlREQUIRE(retval >= 0, done);
+
+    power_mode_update(dev, iov_total(iov, iovcnt));
 
-    // Assume we're at least sub-sector aligned (addr and length)
-    if (len >= FLASH_SPI_FAST_ERASE_SIZE)
+    while (iovcnt > 0)
     {
-        // Check sector alignment (assume power of two for sector size)
-        uint32_t left_over = addr % FLASH_SPI_FAST_ERASE_SIZE;
-        if (left_over)
-        {
-            num_sub_sectors_beg = ((FLASH_SPI_FAST_ERASE_SIZE - left_over) / FLASH_SPI_ERASE_SIZE);
-        }
+        unsigned num_segs = MIN(iovcnt, FLASH_SPI_MAX_IOVECS);
+        size_t len = iov_total(iov, num_segs);
 
-        // Calculate number of sectors (could do with mask and shift...)
-        len -= (num_sub_sectors_beg * FLASH_SPI_ERASE_SIZE);
-        num_sectors = (len / FLASH_SPI_FAST_ERASE_SIZE);
+        retval = spi_cmd_mode_address_segs(dev, &dev->read_cmd_mode, addr + *retlen, false, iov, num_segs);
+        nlREQUIRE(retval >= 0, done);
+        *retlen += len;
 
-        // Finally, get the number of sub-sectors left at the end
-        len -= (num_sectors * FLASH_SPI_FAST_ERASE_SIZE);
-        num_sub_sectors_end = (len / FLASH_SPI_ERASE_SIZE);
-    }
-    else
-    {
-        num_sub_sectors_beg = (len / FLASH_SPI_ERASE_SIZE);
+        iov += num_segs;
+        iovcnt -= num_segs;
     }
 
+done:
+    flash_spi_release(dev);
+    return retval;
+}
+
+// Program each page with one program command carrying the pieces of the
+// buffers that fall in it.
+static int flash_spi_writev(nlflash_spi_device_t *dev, uint32_t addr, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen)
+{
+#if defined(FLASH_SPI_USE_SRAM_BUFFERS) || defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER)
+    // pages are loaded from one buffer, or partial pages are combined
+    // first, so do each buffer through the normal write
     *retlen = 0;
+    return -ENOTSUP;
+#else
+    nlflash_iovec_t pieces[FLASH_SPI_MAX_IOVECS];
+    size_t total = iov_total(iov, iovcnt);
+    size_t offset = 0;
+    unsigned i = 0;
+    int retval;
 
-    for (i = 0; i < num_sub_sectors_beg; i++)
-    {
-        retval = erase_sector(addr, true);
-        nlREQUIRE(retval >= 0, done);
+    *retlen = 0;
 
-        addr += FLASH_SPI_ERASE_SIZE;
-        *retlen += FLASH_SPI_ERASE_SIZE;
+    retval = flash_spi_request(dev);
+    nlREQUIRE(retval >= 0, done);
 
-        if (callback != NULL)
-        {
-            retval = callback();
-            nlREQUIRE(retval >= 0, done);
-        }
-    }
+    power_mode_update(dev, total);
 
-    for (i = 0; i < num_sectors; i++)
+    // not trimmed for FLASH_SPI_USE_SPARSE_WRITE, which only saves time
+    while (*retlen < total)
     {
-        retval = erase_sector(addr, false);
-        nlREQUIRE(retval >= 0, done);
+        uint32_t page_addr = addr + *retlen;
+        size_t room = dev->info.write_size - (page_addr % dev->info.write_size);
+        size_t page_len = 0;
+        unsigned num_pieces = 0;
 
-        addr += FLASH_SPI_FAST_ERASE_SIZE;
-        *retlen += FLASH_SPI_FAST_ERASE_SIZE;
-
-        if (callback != NULL)
+        while ((page_len < room) && (num_pieces < FLASH_SPI_MAX_IOVECS) && (i < iovcnt))
         {
-            retval = callback();
-            nlREQUIRE(retval >= 0, done);
+            size_t n = MIN(iov[i].len - offset, room - page_len);
+
+            if (n > 0)
+            {
+                pieces[num_pieces].base = (uint8_t *)iov[i].base + offset;
+                pieces[num_pieces].len = n;
+                num_pieces++;
+                page_len += n;
+                offset += n;
+            }
+            if (offset == iov[i].len)
+            {
+                i++;
+                offset = 0;
+            }
         }
-    }
 
-    for (i = 0; i < num_sub_sectors_end; i++)
-    {
-        retval = erase_sector(addr, true);
+        retval = spi_cmd_mode_address_segs(dev, &dev->pp_cmd_mode, page_addr, true, pieces, num_pieces);
         nlREQUIRE(retval >= 0, done);
 
-        addr += FLASH_SPI_ERASE_SIZE;
-        *retlen += FLASH_SPI_ERASE_SIZE;
+        retval = program_wait_busy(dev, page_addr, page_len);
+        nlREQUIRE(retval >= 0, done);
 
-        if (callback != NULL)
+#ifdef FLASH_SPI_USE_WRITE_VERIFY
+        for (unsigned j = 0, piece_offset = 0; j < num_pieces; j++)
         {
-            retval = callback();
+            retval = verify_page(dev, page_addr + piece_offset, pieces[j].len, pieces[j].base);
             nlREQUIRE(retval >= 0, done);
+            piece_offset += pieces[j].len;
         }
+#endif
+
+        *retlen += page_len;
     }
 
 done:
-    nlflash_spi_release();
+    flash_spi_release(dev);
     return retval;
+#endif /* defined(FLASH_SPI_USE_SRAM_BUFFERS) || defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
 }
 
-int nlflash_spi_read(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback)
+static int flash_spi_read_id(nlflash_spi_device_t *dev, uint8_t *id_buf, size_t id_buf_size)
 {
     int retval;
 
-    *retlen = 0;
-
-    retval = nlflash_spi_request();
-    nlREQUIRE(retval >= 0, done);
+    if (id_buf_size < FLASH_SPI_READ_ID_SIZE) {
+        return -EINVAL;
+    }
 
-#if FLASH_SPI_HZ > FLASH_SPI_READ_FREQ_HZ
-    // use fast read if the operating frequecy of spi is faster than the regular speed of the FLASH chip
-    retval = spi_cmd_address_data(CMD_FAST_READ, addr, false, buf, len, FLASH_SPI_FAST_READ_DUMMY_CYCLES);
-#else
-    retval = spi_cmd_address_data(CMD_READ, addr, false, buf, len, FLASH_SPI_READ_DUMMY_CYCLES);
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    if (retval < 0)
+        return retval;
 #endif
+
+    retval = flash_spi_request(dev);
     nlREQUIRE(retval >= 0, done);
-    *retlen = len;
 
-done:
-    nlflash_spi_release();
-    return retval;
-}
+    retval = flash_is_busy(dev);
+    nlREQUIRE(retval >= 0, done);
 
-static int write_internal(uint32_t addr, size_t len, const uint8_t *buf)
-{
-    int retval = spi_cmd_address_data(CMD_PP, addr, true, (uint8_t *)buf, len, 0);
+    retval = read_register(dev, CMD_RDID, id_buf, FLASH_SPI_READ_ID_SIZE);
     nlREQUIRE(retval >= 0, done);
 
-    retval = wait_until_not_busy(PP_DELAY_LOOP_COUNT, PP_DELAY_MSEC);
 done:
+    flash_spi_release(dev);
+
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_release(dev->slave);
+#endif
+
     return retval;
 }
 
-int nlflash_spi_write(uint32_t addr, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback)
+// Start a read at addr and leave CS asserted, so each
+// flash_spi_read_session_read() only clocks out data.
+static int flash_spi_read_session_begin(nlflash_spi_device_t *dev, uint32_t addr)
 {
-#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
-    uint32_t address = addr;
-    const uint8_t *buffer = buf;
-    size_t length = len;
-    size_t written = 0;
-    int retval = 0;
-
-    // If not appending to the previously cached page, flush then acquire the cache.
-    if ((length > 0) &&
-        (address != ROUNDDOWN(flash_spi_device.write_loc, FLASH_EXTERNAL_WRITE_SIZE) + flash_spi_device.partial_page_index)) {
-        retval = nlflash_spi_flush();
-        flash_spi_device.write_loc = address;
-    }
+#ifdef FLASH_SPI_USE_READ_SESSION
+    nlspi_transfer_t xfers[2];
+    uint8_t lines[2];
+    unsigned num_xfers;
+    uint8_t cmd_buf[FLASH_SPI_CMD_ADDR_SIZE + FLASH_SPI_MAX_DUMMY_BYTES];
+    int retval;
 
-    // If starting mid-page, cache the data.
-    // If the page boundary is hit, flush the cache.
-    if ((retval >= 0) && (length > 0))
+    if (dev->session_open)
     {
-        size_t offset = address % FLASH_EXTERNAL_WRITE_SIZE;
-        size_t stride = MIN(FLASH_EXTERNAL_WRITE_SIZE - offset, length);
-        uint8_t *cache = flash_spi_device.partial_page + offset;
-
-        if (offset > 0)
-        {
-            memcpy(cache, buffer, stride);
-            flash_spi_device.partial_page_index = offset + stride;
-
-            address += stride;
-            buffer += stride;
-            length -= stride;
-            written += stride;
-        }
-
-        if (flash_spi_device.partial_page_index == FLASH_EXTERNAL_WRITE_SIZE)
-        {
-            retval = nlflash_spi_flush();
-        }
+        return -EBUSY;
     }
 
-    // While there's a full page of data, write the data to flash.
-    if ((retval >= 0) && (length > 0))
+    retval = flash_spi_request(dev);
+    if (retval < 0)
     {
-        size_t stride = FLASH_EXTERNAL_WRITE_SIZE;
-
-        while (length >= stride)
-        {
-            retval = write_internal(address, stride, buffer);
-            if (retval < 0)
-            {
-                break;
-            }
-
-            address += stride;
-            buffer += stride;
-            length -= stride;
-            written += stride;
-        }
-
-        flash_spi_device.write_loc = address;
+        return retval;
     }
 
-    // Cache any data that's left.
-    if ((retval >= 0) && (length > 0))
-    {
-        size_t offset = address % FLASH_EXTERNAL_WRITE_SIZE;
-        size_t stride = length;
-        uint8_t *cache = flash_spi_device.partial_page + offset;
-
-        memcpy(cache, buffer, stride);
-        flash_spi_device.partial_page_index = offset + stride;
+    // the controller is held until the session ends
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    retval = nlspi_request(dev->slave);
+    nlREQUIRE(retval >= 0, release_device);
+#endif
 
-        address += stride;
-        buffer += stride;
-        length -= stride;
-        written += stride;
-    }
+    // abort if FLASH chip is busy
+    retval = flash_is_busy(dev);
+    nlREQUIRE(retval >= 0, release_controller);
 
-    if (retlen != NULL)
-    {
-        *retlen = written;
-    }
+    num_xfers = fill_cmd_xfers(&dev->read_cmd_mode, addr, cmd_buf, xfers, lines);
+    retval = nlspi_transfer_hold(dev->slave, xfers, lines, num_xfers, true);
+    nlREQUIRE(retval >= 0, release_controller);
 
+    dev->session_open = true;
     return retval;
-#else /* !defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
-    int retval;
-    *retlen = 0;
-
-    retval = nlflash_spi_request();
-    nlREQUIRE(retval >= 0, done);
-
-    uint32_t offsetInPage = addr % FLASH_SPI_WRITE_SIZE;
-
-    // write any leading partial pages that don't start on page boundary
-    if (offsetInPage)
-    {
-        int partial_page_size;
-        if (offsetInPage + len > FLASH_SPI_WRITE_SIZE) {
-            partial_page_size = FLASH_SPI_WRITE_SIZE - offsetInPage;
-        } else {
-            partial_page_size = len;
-        }
-        retval = write_internal(addr, partial_page_size, buf);
-        if (retval == 0) {
-            *retlen += partial_page_size;
-            if (partial_page_size == len) {
-                // we wrote it all requested, we're done
-                goto done;
-            }
-        } else {
-            goto done;
-        }
-        len -= partial_page_size;
-        buf += partial_page_size;
-        addr += partial_page_size;
-    }
-    // write any whole pages
-    while (len >= FLASH_SPI_WRITE_SIZE) {
-        retval = write_internal(addr, FLASH_SPI_WRITE_SIZE, buf);
-        if (retval < 0)
-            break;
-        len -= FLASH_SPI_WRITE_SIZE;
-        addr += FLASH_SPI_WRITE_SIZE;
-        buf += FLASH_SPI_WRITE_SIZE;
-        *retlen += FLASH_SPI_WRITE_SIZE;
-    }
-    // write any trailing partial pages
-    if ((retval == 0) && (len > 0)) {
-        retval = write_internal(addr, len, buf);
-        if (retval == 0) {
-            *retlen += len;
-        }
-    }
 
-done:
-    nlflash_spi_release();
+release_controller:
+    // make sure CS isn't left asserted by a partial command
+    nlspi_transfer_hold(dev->slave, NULL, NULL, 0, false);
+#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
+    nlspi_release(dev->slave);
+release_device:
+#endif
+    flash_spi_release(dev);
     return retval;
-#endif /* defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
+#else /* !defined(FLASH_SPI_USE_READ_SESSION) */
+    return -ENOTSUP;
+#endif /* defined(FLASH_SPI_USE_READ_SESSION) */
 }
 
-int nlflash_spi_flush(void)
+static int flash_spi_read_session_read(nlflash_spi_device_t *dev, size_t len, size_t *retlen, uint8_t *buf)
 {
-#ifdef FLASH_SPI_USE_PARTIAL_PAGE_BUFFER
+#ifdef FLASH_SPI_USE_READ_SESSION
+    nlspi_transfer_t xfer;
+    int retval;
 
-    int retval = 0;
+    *retlen = 0;
 
-    if (flash_spi_device.partial_page_index != 0)
+    if (!dev->session_open)
     {
-        // The write location is the destination address,
-        // thus the offset into the page represents the offset
-        // into the page buffer where the valid data starts.
-        uint32_t address = flash_spi_device.write_loc;
-        size_t offset = address % FLASH_EXTERNAL_WRITE_SIZE;
-        size_t stride = flash_spi_device.partial_page_index > offset ?
-                        flash_spi_device.partial_page_index - offset: 0;
-        uint8_t *cache = flash_spi_device.partial_page + offset;
+        return -EINVAL;
+    }
 
-        retval = write_internal(address, stride, cache);
+    xfer.tx = NULL;
+    xfer.rx = buf;
+    xfer.num = len;
+    xfer.callback = NULL;
 
-        // Reset the partial page
-        if (retval >= 0)
-        {
-            flash_spi_device.write_loc = 0;
-            flash_spi_device.partial_page_index = 0;
-            memset(flash_spi_device.partial_page, 0xff, sizeof(flash_spi_device.partial_page));
-        }
+    // the chip keeps incrementing the address for as long as CS is asserted
+    retval = nlspi_transfer_hold(dev->slave, &xfer, &dev->read_cmd_mode.data_lines, 1, true);
+    if (retval >= 0)
+    {
+        *retlen = len;
     }
     return retval;
-
-#else /* !defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
-
-    return 0;
-
-#endif /* defined(FLASH_SPI_USE_PARTIAL_PAGE_BUFFER) */
+#else /* !defined(FLASH_SPI_USE_READ_SESSION) */
+    return -ENOTSUP;
+#endif /* defined(FLASH_SPI_USE_READ_SESSION) */
 }
 
-int nlflash_spi_read_id(uint8_t *id_buf, size_t id_buf_size)
+static int flash_spi_read_session_end(nlflash_spi_device_t *dev)
 {
+#ifdef FLASH_SPI_USE_READ_SESSION
     int retval;
 
-    if (id_buf_size < FLASH_SPI_READ_ID_SIZE) {
+    if (!dev->session_open)
+    {
         return -EINVAL;
     }
 
+    retval = nlspi_transfer_hold(dev->slave, NULL, NULL, 0, false);
+    dev->session_open = false;
+
 #if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-    retval = nlspi_request(&g_flash_spi_slave);
-    if (retval < 0)
-        return retval;
+    nlspi_release(dev->slave);
 #endif
+    flash_spi_release(dev);
 
-    retval = nlflash_spi_request();
-    nlREQUIRE(retval >= 0, done);
-
-    retval = flash_is_busy();
-    nlREQUIRE(retval >= 0, done);
-
-    retval = read_register(CMD_RDID, id_buf, FLASH_SPI_READ_ID_SIZE);
-    nlREQUIRE(retval >= 0, done);
-
-done:
-    nlflash_spi_release();
+    return retval;
+#else /* !defined(FLASH_SPI_USE_READ_SESSION) */
+    return -ENOTSUP;
+#endif /* defined(FLASH_SPI_USE_READ_SESSION) */
+}
 
-#if (FLASH_SPI_SPLIT_TRANSACTIONS == 1)
-    retval = nlspi_release(&g_flash_spi_slave);
-#endif
+static int flash_spi_get_verify_failure(nlflash_spi_device_t *dev, uint32_t *addr)
+{
+#ifdef FLASH_SPI_USE_WRITE_VERIFY
+    int retval = -ENOENT;
 
+    if (dev->verify_failed)
+    {
+        *addr = dev->verify_fail_addr;
+        dev->verify_failed = false;
+        retval = 0;
+    }
     return retval;
+#else /* !defined(FLASH_SPI_USE_WRITE_VERIFY) */
+    return -ENOENT;
+#endif /* defined(FLASH_SPI_USE_WRITE_VERIFY) */
+}
+
+// The policy takes effect on the device's next read, program or erase.
+static int flash_spi_set_power_mode(nlflash_spi_device_t *dev, nlflash_spi_power_mode_t mode)
+{
+#ifdef FLASH_SPI_USE_POWER_MODE
+    if ((unsigned)mode > NLFLASH_SPI_POWER_MODE_HIGH_PERFORMANCE)
+    {
+        return -EINVAL;
+    }
+    dev->power_mode = mode;
+    return 0;
+#else /* !defined(FLASH_SPI_USE_POWER_MODE) */
+    return -ENOTSUP;
+#endif /* defined(FLASH_SPI_USE_POWER_MODE) */
 }
 
-const nlflash_info_t *nlflash_spi_get_info(void)
+static const nlflash_info_t *flash_spi_get_info(nlflash_spi_device_t *dev)
 {
-    return &g_flash_spi_info;
+    return &dev->info;
+}
+
+// The nlflash_func_table_t entries for device n, named prefix_<op>.
+#define FLASH_SPI_DEFINE_DEVICE_FUNCS(prefix, n)                                                                 \
+int prefix##_init(void)                                                                                          \
+{                                                                                                                \
+    return flash_spi_init(&s_flash_spi_devices[n]);                                                              \
+}                                                                                                                \
+int prefix##_request(void)                                                                                       \
+{                                                                                                                \
+    return flash_spi_request(&s_flash_spi_devices[n]);                                                           \
+}                                                                                                                \
+int prefix##_release(void)                                                                                       \
+{                                                                                                                \
+    return flash_spi_release(&s_flash_spi_devices[n]);                                                           \
+}                                                                                                                \
+const nlflash_info_t *prefix##_get_info(void)                                                                    \
+{                                                                                                                \
+    return flash_spi_get_info(&s_flash_spi_devices[n]);                                                          \
+}                                                                                                                \
+int prefix##_read_id(uint8_t *id_buf, size_t id_buf_size)                                                       \
+{                                                                                                                \
+    return flash_spi_read_id(&s_flash_spi_devices[n], id_buf, id_buf_size);                                      \
+}                                                                                                                \
+int prefix##_erase(uint32_t addr, size_t len, size_t *retlen, nlloop_callback_fp callback)                      \
+{                                                                                                                \
+    return flash_spi_erase(&s_flash_spi_devices[n], addr, len, retlen, callback);                                \
+}                                                                                                                \
+int prefix##_erase_blank_check(uint32_t addr, size_t len, size_t *retlen, size_t *skipped,                      \
+                               nlloop_callback_fp callback)                                                      \
+{                                                                                                                \
+    return flash_spi_erase_blank_check(&s_flash_spi_devices[n], addr, len, retlen, skipped, callback);           \
+}                                                                                                                \
+int prefix##_read(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback)         \
+{                                                                                                                \
+    return flash_spi_read(&s_flash_spi_devices[n], addr, len, retlen, buf, callback);                            \
+}                                                                                                                \
+int prefix##_write(uint32_t addr, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback)  \
+{                                                                                                                \
+    return flash_spi_write(&s_flash_spi_devices[n], addr, len, retlen, buf, callback);                           \
+}                                                                                                                \
+int prefix##_flush(void)                                                                                         \
+{                                                                                                                \
+    return flash_spi_flush(&s_flash_spi_devices[n]);                                                             \
+}                                                                                                                \
+int prefix##_flush_range(uint32_t addr, size_t len)                                                              \
+{                                                                                                                \
+    return flash_spi_flush_range(&s_flash_spi_devices[n], addr, len);                                            \
+}                                                                                                                \
+int prefix##_write_stream(uint32_t addr, size_t len, size_t *retlen, nlflash_write_producer_t producer,         \
+                          void *context)                                                                         \
+{                                                                                                                \
+    return flash_spi_write_stream(&s_flash_spi_devices[n], addr, len, retlen, producer, context);                \
+}                                                                                                                \
+int prefix##_get_erase_time(uint32_t addr, size_t len, uint32_t *usec)                                           \
+{                                                                                                                \
+    return flash_spi_get_erase_time(&s_flash_spi_devices[n], addr, len, usec);                                   \
+}                                                                                                                \
+int prefix##_read_async(uint32_t addr, size_t len, uint8_t *buf, nlflash_async_handler_t callback, void *context) \
+{                                                                                                                \
+    return flash_spi_read_async(&s_flash_spi_devices[n], addr, len, buf, callback, context);                     \
+}                                                                                                                \
+int prefix##_read_async_finish(void)                                                                             \
+{                                                                                                                \
+    return flash_spi_read_async_finish(&s_flash_spi_devices[n]);                                                 \
+}                                                                                                                \
+int prefix##_read_preempt(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf)                               \
+{                                                                                                                \
+    return flash_spi_read_preempt(&s_flash_spi_devices[n], addr, len, retlen, buf);                              \
+}                                                                                                                \
+int prefix##_get_verify_failure(uint32_t *addr)                                                                  \
+{                                                                                                                \
+    return flash_spi_get_verify_failure(&s_flash_spi_devices[n], addr);                                          \
+}                                                                                                                \
+int prefix##_read_session_begin(uint32_t addr)                                                                   \
+{                                                                                                                \
+    return flash_spi_read_session_begin(&s_flash_spi_devices[n], addr);                                          \
+}                                                                                                                \
+int prefix##_read_session_read(size_t len, size_t *retlen, uint8_t *buf)                                         \
+{                                                                                                                \
+    return flash_spi_read_session_read(&s_flash_spi_devices[n], len, retlen, buf);                               \
+}                                                                                                                \
+int prefix##_read_session_end(void)                                                                              \
+{                                                                                                                \
+    return flash_spi_read_session_end(&s_flash_spi_devices[n]);                                                  \
+}                                                                                                                \
+int prefix##_set_power_mode(nlflash_spi_power_mode_t mode)                                                       \
+{                                                                                                                \
+    return flash_spi_set_power_mode(&s_flash_spi_devices[n], mode);                                              \
+}                                                                                                                \
+int prefix##_write_start(uint32_t addr, size_t len, const uint8_t *buf)                                          \
+{                                                                                                                \
+    return flash_spi_write_start(&s_flash_spi_devices[n], addr, len, buf);                                       \
+}                                                                                                                \
+int prefix##_write_finish(void)                                                                                  \
+{                                                                                                                \
+    return flash_spi_write_finish(&s_flash_spi_devices[n]);                                                      \
+}                                                                                                                \
+int prefix##_erase_start(uint32_t addr, size_t len)                                                              \
+{                                                                                                                \
+    return flash_spi_erase_start(&s_flash_spi_devices[n], addr, len);                                            \
+}                                                                                                                \
+int prefix##_erase_finish(void)                                                                                  \
+{                                                                                                                \
+    return flash_spi_erase_finish(&s_flash_spi_devices[n]);                                                      \
+}                                                                                                                \
+int prefix##_readv(uint32_t addr, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen)                   \
+{                                                                                                                \
+    return flash_spi_readv(&s_flash_spi_devices[n], addr, iov, iovcnt, retlen);                                  \
+}                                                                                                                \
+int prefix##_writev(uint32_t addr, const nlflash_iovec_t *iov, unsigned iovcnt, size_t *retlen)                  \
+{                                                                                                                \
+    return flash_spi_writev(&s_flash_spi_devices[n], addr, iov, iovcnt, retlen);                                 \
 }
+
+FLASH_SPI_DEFINE_DEVICE_FUNCS(nlflash_spi, 0)
+#if FLASH_SPI_NUM_DEVICES > 1
+FLASH_SPI_DEFINE_DEVICE_FUNCS(nlflash_spi1, 1)
+#endif
+#if FLASH_SPI_NUM_DEVICES > 2
+FLASH_SPI_DEFINE_DEVICE_FUNCS(nlflash_spi2, 2)
+#endif
+#if FLASH_SPI_NUM_DEVICES > 3
+FLASH_SPI_DEFINE_DEVICE_FUNCS(nlflash_spi3, 3)
+#endif
 #endif /* FLASH_SPI_SIZE > 0 */
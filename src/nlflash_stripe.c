@@ -0,0 +1,430 @@
+/*
+ *
+ *    Copyright (c) 2018 Nest Labs, Inc.
+ *    All rights reserved.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ *    Description:
+ *      This file implements a flash striped across two flash devices
+ *      registered in g_flash_device_table.  Like the other flash
+ *      drivers it's called by the nlflash.c layer with the striped
+ *      flash's lock held, and goes through nlflash.c for the devices,
+ *      so their locks are taken too.
+ *
+ */
+
+#include <nlassert.h>
+#include <errno.h>
+#include <string.h>
+#include <nlplatform.h>
+
+#include <nlplatform/nlflash.h>
+#include <nlplatform/nlflash_stripe.h>
+#include <nlutilities.h>
+
+// a piece of a striped flash range that is on one device
+typedef struct {
+    nlflash_id_t id;
+    uint32_t addr;
+    size_t len;
+} stripe_chunk_t;
+
+static nlflash_info_t s_stripe_info;
+
+// Map the start of [addr, addr + len) to the device holding it, up to the
+// end of its page.
+static void stripe_map(uint32_t addr, size_t len, stripe_chunk_t *chunk)
+{
+    uint32_t page_size = s_stripe_info.write_size;
+    uint32_t page = addr / page_size;
+    uint32_t offset = addr % page_size;
+
+    chunk->id = g_flash_stripe_config.ids[page % 2];
+    chunk->addr = (page / 2) * page_size + offset;
+    chunk->len = MIN(page_size - offset, len);
+}
+
+int nlflash_stripe_init(void)
+{
+    const nlflash_info_t *info0 = nlflash_get_info(g_flash_stripe_config.ids[0]);
+    const nlflash_info_t *info1 = nlflash_get_info(g_flash_stripe_config.ids[1]);
+
+    nlASSERT(info0->size == info1->size);
+    nlASSERT(info0->erase_size == info1->erase_size);
+    nlASSERT(info0->fast_erase_size == info1->fast_erase_size);
+    nlASSERT(info0->write_size == info1->write_size);
+    // a page on each device fits in an erase block on each
+    nlASSERT(info0->erase_size % info0->write_size == 0);
+
+    s_stripe_info.name = g_flash_stripe_config.name;
+    s_stripe_info.base_addr = 0;
+    s_stripe_info.size = 2 * info0->size;
+    s_stripe_info.erase_size = 2 * info0->erase_size;
+    s_stripe_info.fast_erase_size = 2 * info0->fast_erase_size;
+    s_stripe_info.write_size = info0->write_size;
+
+    return 0;
+}
+
+int nlflash_stripe_request(void)
+{
+    int retval;
+
+    retval = nlflash_begin(g_flash_stripe_config.ids[0]);
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    retval = nlflash_begin(g_flash_stripe_config.ids[1]);
+    if (retval < 0)
+    {
+        nlflash_end(g_flash_stripe_config.ids[0]);
+    }
+    return retval;
+}
+
+int nlflash_stripe_release(void)
+{
+    int retval;
+    int retval0;
+
+    retval = nlflash_end(g_flash_stripe_config.ids[1]);
+    retval0 = nlflash_end(g_flash_stripe_config.ids[0]);
+    if ((retval0 < 0) && (retval >= 0))
+    {
+        retval = retval0;
+    }
+    return retval;
+}
+
+int nlflash_stripe_flush(void)
+{
+    int retval;
+
+    retval = nlflash_flush(g_flash_stripe_config.ids[0]);
+    if (retval >= 0)
+    {
+        retval = nlflash_flush(g_flash_stripe_config.ids[1]);
+    }
+    return retval;
+}
+
+int nlflash_stripe_flush_range(uint32_t addr, size_t len)
+{
+    uint32_t row_size = 2 * s_stripe_info.write_size;
+    // each device's part of the range is within the same rows of pages
+    uint32_t start = (addr / row_size) * s_stripe_info.write_size;
+    uint32_t end = ((addr + len + row_size - 1) / row_size) * s_stripe_info.write_size;
+    int retval;
+
+    retval = nlflash_flush_range(g_flash_stripe_config.ids[0], start, end - start);
+    if (retval >= 0)
+    {
+        retval = nlflash_flush_range(g_flash_stripe_config.ids[1], start, end - start);
+    }
+    return retval;
+}
+
+const nlflash_info_t *nlflash_stripe_get_info(void)
+{
+    return &s_stripe_info;
+}
+
+// whether both devices can start an erase without waiting for it
+static bool stripe_can_erase_concurrently(void)
+{
+    unsigned i;
+
+    for (i = 0; i < 2; i++)
+    {
+        const nlflash_func_table_t *table = &g_flash_device_table[g_flash_stripe_config.ids[i]];
+
+        if ((table->erase_start == NULL) || (table->erase_finish == NULL))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Erase the block at addr on both devices, which is half of a striped
+// block, at the same time on devices that can start an erase without
+// waiting for it.
+static int stripe_erase_block(uint32_t addr, size_t len)
+{
+    bool started[2] = { false, false };
+    int retval = 0;
+    unsigned i;
+
+    for (i = 0; (i < 2) && (retval >= 0); i++)
+    {
+        const nlflash_func_table_t *table = &g_flash_device_table[g_flash_stripe_config.ids[i]];
+
+        if ((table->erase_start != NULL) && (table->erase_finish != NULL))
+        {
+            retval = table->erase_start(addr, len);
+            started[i] = (retval >= 0);
+        }
+        else
+        {
+            size_t block_retlen;
+
+            retval = table->erase(addr, len, &block_retlen, NULL);
+        }
+    }
+
+    // wait for every erase that started, even after a failure
+    for (i = 0; i < 2; i++)
+    {
+        if (started[i])
+        {
+            int finish_retval = g_flash_device_table[g_flash_stripe_config.ids[i]].erase_finish();
+
+            if ((finish_retval < 0) && (retval >= 0))
+            {
+                retval = finish_retval;
+            }
+        }
+        // the devices are erased behind nlflash_erase()
+        nlflash_cache_invalidate(g_flash_stripe_config.ids[i], addr, len);
+    }
+    return retval;
+}
+
+// nlflash.c has checked the range is made of whole striped erase blocks,
+// which are the same half-size blocks on each device.
+int nlflash_stripe_erase(uint32_t addr, size_t len, size_t *retlen, nlloop_callback_fp callback)
+{
+    uint32_t fast_block_size = s_stripe_info.fast_erase_size / 2;
+    uint32_t block_size = s_stripe_info.erase_size / 2;
+    uint32_t start = addr / 2;
+    uint32_t end = (addr + len) / 2;
+    uint32_t block_addr = start;
+    int retval;
+
+    *retlen = 0;
+
+    // locks both devices, so their tables can be used directly
+    retval = nlflash_stripe_request();
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    while (block_addr < end)
+    {
+        // the largest block on the devices that is aligned and fits
+        uint32_t size = (((block_addr % fast_block_size) == 0) && (end - block_addr >= fast_block_size)) ?
+                        fast_block_size : block_size;
+
+        retval = stripe_erase_block(block_addr, size);
+        if (retval < 0)
+        {
+            break;
+        }
+        block_addr += size;
+
+        // a striped block is only erased once both halves are
+        *retlen = 2 * (block_addr - start);
+
+        if (callback != NULL)
+        {
+            retval = callback();
+            if (retval < 0)
+            {
+                break;
+            }
+        }
+    }
+
+    nlflash_stripe_release();
+    return retval;
+}
+
+int nlflash_stripe_get_erase_time(uint32_t addr, size_t len, uint32_t *usec)
+{
+    uint32_t usec0;
+    uint32_t usec1;
+    int retval;
+
+    retval = nlflash_get_erase_time(g_flash_stripe_config.ids[0], addr / 2, len / 2, &usec0);
+    if (retval >= 0)
+    {
+        retval = nlflash_get_erase_time(g_flash_stripe_config.ids[1], addr / 2, len / 2, &usec1);
+    }
+    if (retval >= 0)
+    {
+        // the devices erase each block at the same time if they can,
+        // else one after the other
+        *usec = stripe_can_erase_concurrently() ? MAX(usec0, usec1) : usec0 + usec1;
+    }
+    return retval;
+}
+
+int nlflash_stripe_read(uint32_t addr, size_t len, size_t *retlen, uint8_t *buf, nlloop_callback_fp callback)
+{
+    int retval;
+
+    *retlen = 0;
+
+    // keep both devices powered between pages
+    retval = nlflash_stripe_request();
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    while (*retlen < len)
+    {
+        stripe_chunk_t chunk;
+        size_t chunk_retlen;
+
+        stripe_map(addr + *retlen, len - *retlen, &chunk);
+        retval = nlflash_read(chunk.id, chunk.addr, chunk.len, &chunk_retlen, buf + *retlen, NULL);
+        if (retval < 0)
+        {
+            break;
+        }
+        *retlen += chunk_retlen;
+        if (chunk_retlen < chunk.len)
+        {
+            // the rest of the stripe isn't contiguous with what was read
+            break;
+        }
+
+        if (callback != NULL)
+        {
+            retval = callback();
+            if (retval < 0)
+            {
+                break;
+            }
+        }
+    }
+
+    nlflash_stripe_release();
+    return retval;
+}
+
+// Program the chunks, which are on different devices, at the same time on
+// devices that can start a program without waiting for it.  *retlen gets
+// the bytes from the start of buf that were programmed.
+static int stripe_program(const stripe_chunk_t *chunks, unsigned num_chunks, const uint8_t *buf, size_t *retlen)
+{
+    bool started[2] = { false, false };
+    size_t chunk_retlen[2] = { 0, 0 };
+    const uint8_t *chunk_buf = buf;
+    int retval = 0;
+    unsigned i;
+
+    for (i = 0; (i < num_chunks) && (retval >= 0); i++)
+    {
+        const nlflash_func_table_t *table = &g_flash_device_table[chunks[i].id];
+
+        if ((table->write_start != NULL) && (table->write_finish != NULL))
+        {
+            retval = table->write_start(chunks[i].addr, chunks[i].len, chunk_buf);
+            started[i] = (retval >= 0);
+        }
+        else
+        {
+            retval = table->write(chunks[i].addr, chunks[i].len, &chunk_retlen[i], chunk_buf, NULL);
+        }
+        chunk_buf += chunks[i].len;
+    }
+
+    // wait for every program that started, even after a failure
+    for (i = 0; i < num_chunks; i++)
+    {
+        if (started[i])
+        {
+            int finish_retval = g_flash_device_table[chunks[i].id].write_finish();
+
+            if (finish_retval >= 0)
+            {
+                chunk_retlen[i] = chunks[i].len;
+            }
+            else if (retval >= 0)
+            {
+                retval = finish_retval;
+            }
+        }
+        // the devices are written behind nlflash_write()
+        nlflash_cache_invalidate(chunks[i].id, chunks[i].addr, chunks[i].len);
+    }
+
+    // the stripe is only written up to the first short chunk
+    *retlen = 0;
+    for (i = 0; i < num_chunks; i++)
+    {
+        *retlen += chunk_retlen[i];
+        if (chunk_retlen[i] < chunks[i].len)
+        {
+            break;
+        }
+    }
+    return retval;
+}
+
+int nlflash_stripe_write(uint32_t addr, size_t len, size_t *retlen, const uint8_t *buf, nlloop_callback_fp callback)
+{
+    int retval;
+
+    *retlen = 0;
+
+    // locks both devices, so their tables can be used directly
+    retval = nlflash_stripe_request();
+    if (retval < 0)
+    {
+        return retval;
+    }
+
+    while (*retlen < len)
+    {
+        stripe_chunk_t chunks[2];
+        unsigned num_chunks = 0;
+        size_t offset = *retlen;
+        size_t programmed;
+
+        // consecutive pages are on alternate devices
+        while ((num_chunks < ARRAY_SIZE(chunks)) && (offset < len))
+        {
+            stripe_map(addr + offset, len - offset, &chunks[num_chunks]);
+            offset += chunks[num_chunks].len;
+            num_chunks++;
+        }
+
+        retval = stripe_program(chunks, num_chunks, buf + *retlen, &programmed);
+        *retlen += programmed;
+        if ((retval < 0) || (*retlen < offset))
+        {
+            break;
+        }
+
+        if (callback != NULL)
+        {
+            retval = callback();
+            if (retval < 0)
+            {
+                break;
+            }
+        }
+    }
+
+    nlflash_stripe_release();
+    return retval;
+}
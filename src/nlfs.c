@@ -56,6 +56,12 @@
 #define NL_FS_CRC_SEED NLCRC_SEED_DEFAULT
 #endif
 
+// only erase the sectors of a partition that aren't already blank when
+// opening it for writing
+#ifndef NL_FS_USE_ERASE_BLANK_CHECK
+#define NL_FS_USE_ERASE_BLANK_CHECK 0
+#endif
+
 static int readFile(void* buf, uint32_t from, size_t len, void* context)
 {
     size_t retlen;
@@ -273,7 +279,13 @@ int nlfs_open_cb(nlfs_fileid_t fid, nlfs_file_mode_t mode, nlfs_image_location_t
                 size_t retlen;
 
                 // Get the device and tell it to do its own locking during the erase
+#if NL_FS_USE_ERASE_BLANK_CHECK
+                size_t skipped;
+
+                retval = nlflash_erase_blank_check(file->chipId, file->offset, file->len, &retlen, &skipped, callback);
+#else
                 retval = nlflash_erase(file->chipId, file->offset, file->len, &retlen, callback);
+#endif
                 if ((retval >= 0) && (retlen != file->len))
                 {
                     retval = -EIO;
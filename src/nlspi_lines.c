@@ -0,0 +1,52 @@
+/*
+ *
+ *    Copyright (c) 2018 Nest Labs, Inc.
+ *    All rights reserved.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ *    Description:
+ *      This file implements a default nlspi_transfer_lines() for
+ *      spi controllers without dual or quad lines.  Controllers
+ *      that have them replace it with their own.
+ *
+ */
+
+#include <errno.h>
+#include <nlplatform.h>
+#include <nlplatform/nlspi.h>
+
+int nlspi_transfer_lines(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, const uint8_t *lines,
+                         unsigned num_transfers) LINKER_REPLACEABLE_FUNCTION(nlspi_transfer_lines_default);
+
+/* not static so the compiler doesn't inline it and prevent linker script replacement from working */
+int nlspi_transfer_lines_default(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, const uint8_t *lines,
+                                 unsigned num_transfers);
+
+int nlspi_transfer_lines_default(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, const uint8_t *lines,
+                                 unsigned num_transfers)
+{
+    unsigned i;
+
+    for (i = 0; i < num_transfers; i++)
+    {
+        if (lines[i] != NLSPI_LINES_SINGLE)
+        {
+            return -ENOTSUP;
+        }
+    }
+
+    return nlspi_transfer(spi_slave, transfers, num_transfers);
+}
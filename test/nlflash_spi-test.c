@@ -0,0 +1,285 @@
+/*
+ *
+ *    Copyright (c) 2018 Nest Labs, Inc.
+ *    All rights reserved.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *        http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+/*
+ *    Description:
+ *      This file implements a host unit test suite checking the
+ *      framing of the dual and quad commands nlflash_spi.c sends.
+ *      It includes nlflash_spi.c, to get at its static functions,
+ *      and runs it against a stand-in nlspi that records each
+ *      transfer, so it's built as its own program rather than
+ *      as part of nlplatform, with the simulator's product config
+ *      for a chip with quad commands (MX25R/MX25U), e.g.
+ *
+ *        cc -DBUILD_FEATURE_UNIT_TEST -DNL_NO_RTOS <include paths> \
+ *            test/nlflash_spi-test.c -o nlflash_spi-test
+ *
+ */
+
+#ifdef BUILD_FEATURE_UNIT_TEST
+
+#include <stdio.h>
+#include <string.h>
+
+// build the multi-line paths, whatever the product selects
+#undef FLASH_SPI_READ_MODE
+#define FLASH_SPI_READ_MODE FLASH_SPI_READ_MODE_QUAD_IO
+#ifndef FLASH_SPI_USE_QUAD_PP
+#define FLASH_SPI_USE_QUAD_PP
+#endif
+
+#include "../src/nlflash_spi.c"
+
+#include "nltest.h"
+
+#if !defined(CMD_DREAD) || !defined(CMD_QREAD) || !defined(CMD_4READ) || !defined(CMD_4PP)
+#error "nlflash_spi-test needs a chip with dual and quad commands"
+#endif
+
+#define TEST_ADDR           0x123456
+#define TEST_DATA_SIZE      16
+#define MAX_RECORDED_XFERS  (2 + FLASH_SPI_MAX_IOVECS)
+#define MAX_RECORDED_TX     (FLASH_SPI_CMD_ADDR_SIZE + FLASH_SPI_MAX_DUMMY_BYTES)
+
+// the last transfer list sent to the stand-in controller
+typedef struct {
+    unsigned num_xfers;
+    uint8_t lines[MAX_RECORDED_XFERS];
+    uint32_t num[MAX_RECORDED_XFERS];
+    const uint8_t *tx[MAX_RECORDED_XFERS];
+    uint8_t *rx[MAX_RECORDED_XFERS];
+    // copies, since cmd_buf is on the sender's stack
+    uint8_t tx_data[MAX_RECORDED_XFERS][MAX_RECORDED_TX];
+} recorded_transfer_t;
+
+static recorded_transfer_t s_recorded;
+static unsigned s_num_wren;
+
+const nlspi_slave_t g_flash_spi_slave;
+
+static int record_transfer(nlspi_transfer_t *transfers, const uint8_t *lines, unsigned num_transfers)
+{
+    unsigned i;
+
+    memset(&s_recorded, 0, sizeof(s_recorded));
+    if (num_transfers > MAX_RECORDED_XFERS)
+    {
+        return -EINVAL;
+    }
+
+    s_recorded.num_xfers = num_transfers;
+    for (i = 0; i < num_transfers; i++)
+    {
+        s_recorded.lines[i] = (lines != NULL) ? lines[i] : NLSPI_LINES_SINGLE;
+        s_recorded.num[i] = transfers[i].num;
+        s_recorded.tx[i] = transfers[i].tx;
+        s_recorded.rx[i] = transfers[i].rx;
+        if (transfers[i].tx != NULL)
+        {
+            memcpy(s_recorded.tx_data[i], transfers[i].tx, MIN(transfers[i].num, MAX_RECORDED_TX));
+        }
+        if (transfers[i].rx != NULL)
+        {
+            // reads as a ready status
+            memset(transfers[i].rx, 0, transfers[i].num);
+        }
+    }
+    return 0;
+}
+
+int nlspi_transfer(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, unsigned num_transfers)
+{
+    return record_transfer(transfers, NULL, num_transfers);
+}
+
+int nlspi_transfer_lines(const nlspi_slave_t *spi_slave, nlspi_transfer_t *transfers, const uint8_t *lines,
+                         unsigned num_transfers)
+{
+    return record_transfer(transfers, lines, num_transfers);
+}
+
+int nlspi_write(const nlspi_slave_t *spi_slave, const uint8_t *buf, size_t len)
+{
+    if ((len == 1) && (buf[0] == CMD_WREN))
+    {
+        s_num_wren++;
+    }
+    return 0;
+}
+
+int nlspi_request(const nlspi_slave_t *spi_slave)
+{
+    return 0;
+}
+
+int nlspi_release(const nlspi_slave_t *spi_slave)
+{
+    return 0;
+}
+
+void nlspi_slave_enable(const nlspi_slave_t *spi_slave)
+{
+}
+
+void nlspi_slave_disable(const nlspi_slave_t *spi_slave)
+{
+}
+
+void nlplatform_delay_us(unsigned delay_us)
+{
+}
+
+void nlplatform_delay_ms(unsigned delay_ms)
+{
+}
+
+bool nlflash_buf_is_blank(const void *buf, size_t len)
+{
+    const uint8_t *bytes = buf;
+
+    while (len-- > 0)
+    {
+        if (*bytes++ != 0xFF)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool all_dummy(const uint8_t *buf, size_t len)
+{
+    return nlflash_buf_is_blank(buf, len);
+}
+
+static bool address_is(const uint8_t *buf, uint32_t addr)
+{
+    return ((buf[0] == ((addr >> 16) & 0xFF)) &&
+            (buf[1] == ((addr >> 8) & 0xFF)) &&
+            (buf[2] == (addr & 0xFF)));
+}
+
+// cmd, address and dummy bytes on one line, then the data on data_lines
+static void check_output_read(nlTestSuite *inSuite, uint8_t cmd, uint8_t data_lines, uint8_t dummy_bytes)
+{
+    const flash_spi_cmd_mode_t mode = { cmd, NLSPI_LINES_SINGLE, data_lines, dummy_bytes };
+    uint8_t buf[TEST_DATA_SIZE];
+    int retval;
+
+    retval = spi_cmd_mode_address_data(&s_flash_spi_devices[0], &mode, TEST_ADDR, false, buf, sizeof(buf));
+    NL_TEST_ASSERT(inSuite, retval >= 0);
+
+    NL_TEST_ASSERT(inSuite, s_recorded.num_xfers == 2);
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[0] == NLSPI_LINES_SINGLE);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[0] == FLASH_SPI_CMD_ADDR_SIZE + dummy_bytes);
+    NL_TEST_ASSERT(inSuite, s_recorded.tx_data[0][0] == cmd);
+    NL_TEST_ASSERT(inSuite, address_is(&s_recorded.tx_data[0][1], TEST_ADDR));
+    NL_TEST_ASSERT(inSuite, all_dummy(&s_recorded.tx_data[0][FLASH_SPI_CMD_ADDR_SIZE], dummy_bytes));
+
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[1] == data_lines);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[1] == sizeof(buf));
+    NL_TEST_ASSERT(inSuite, s_recorded.tx[1] == NULL);
+    NL_TEST_ASSERT(inSuite, s_recorded.rx[1] == buf);
+}
+
+static void TestDualOutputRead(nlTestSuite *inSuite, void *inContext)
+{
+    check_output_read(inSuite, CMD_DREAD, NLSPI_LINES_DUAL, FLASH_SPI_DREAD_DUMMY_CYCLES);
+}
+
+static void TestQuadOutputRead(nlTestSuite *inSuite, void *inContext)
+{
+    check_output_read(inSuite, CMD_QREAD, NLSPI_LINES_QUAD, FLASH_SPI_QREAD_DUMMY_CYCLES);
+}
+
+// cmd on one line, then the address and mode/dummy bytes and the data on four
+static void TestQuadIORead(nlTestSuite *inSuite, void *inContext)
+{
+    const flash_spi_cmd_mode_t mode = { CMD_4READ, NLSPI_LINES_QUAD, NLSPI_LINES_QUAD, FLASH_SPI_4READ_DUMMY_CYCLES };
+    uint8_t buf[TEST_DATA_SIZE];
+    int retval;
+
+    retval = spi_cmd_mode_address_data(&s_flash_spi_devices[0], &mode, TEST_ADDR, false, buf, sizeof(buf));
+    NL_TEST_ASSERT(inSuite, retval >= 0);
+
+    NL_TEST_ASSERT(inSuite, s_recorded.num_xfers == 3);
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[0] == NLSPI_LINES_SINGLE);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[0] == 1);
+    NL_TEST_ASSERT(inSuite, s_recorded.tx_data[0][0] == CMD_4READ);
+
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[1] == NLSPI_LINES_QUAD);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[1] == FLASH_SPI_CMD_ADDR_SIZE - 1 + FLASH_SPI_4READ_DUMMY_CYCLES);
+    NL_TEST_ASSERT(inSuite, address_is(s_recorded.tx_data[1], TEST_ADDR));
+    // the first is the mode byte, which must not enter continuous read mode
+    NL_TEST_ASSERT(inSuite, all_dummy(&s_recorded.tx_data[1][FLASH_SPI_CMD_ADDR_SIZE - 1], FLASH_SPI_4READ_DUMMY_CYCLES));
+
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[2] == NLSPI_LINES_QUAD);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[2] == sizeof(buf));
+    NL_TEST_ASSERT(inSuite, s_recorded.rx[2] == buf);
+}
+
+// WREN, then cmd on one line and the address and data on four
+static void TestQuadPageProgram(nlTestSuite *inSuite, void *inContext)
+{
+    const flash_spi_cmd_mode_t mode = { CMD_4PP, NLSPI_LINES_QUAD, NLSPI_LINES_QUAD, 0 };
+    uint8_t buf[TEST_DATA_SIZE];
+    unsigned num_wren = s_num_wren;
+    int retval;
+
+    memset(buf, 0x5A, sizeof(buf));
+
+    retval = spi_cmd_mode_address_data(&s_flash_spi_devices[0], &mode, TEST_ADDR, true, buf, sizeof(buf));
+    NL_TEST_ASSERT(inSuite, retval >= 0);
+    NL_TEST_ASSERT(inSuite, s_num_wren == num_wren + 1);
+
+    NL_TEST_ASSERT(inSuite, s_recorded.num_xfers == 3);
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[0] == NLSPI_LINES_SINGLE);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[0] == 1);
+    NL_TEST_ASSERT(inSuite, s_recorded.tx_data[0][0] == CMD_4PP);
+
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[1] == NLSPI_LINES_QUAD);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[1] == FLASH_SPI_CMD_ADDR_SIZE - 1);
+    NL_TEST_ASSERT(inSuite, address_is(s_recorded.tx_data[1], TEST_ADDR));
+
+    NL_TEST_ASSERT(inSuite, s_recorded.lines[2] == NLSPI_LINES_QUAD);
+    NL_TEST_ASSERT(inSuite, s_recorded.num[2] == sizeof(buf));
+    NL_TEST_ASSERT(inSuite, s_recorded.tx[2] == buf);
+    NL_TEST_ASSERT(inSuite, s_recorded.rx[2] == NULL);
+}
+
+static const nlTest sTests[] = {
+    NL_TEST_DEF("dual output read", TestDualOutputRead),
+    NL_TEST_DEF("quad output read", TestQuadOutputRead),
+    NL_TEST_DEF("quad I/O read", TestQuadIORead),
+    NL_TEST_DEF("quad page program", TestQuadPageProgram),
+    NL_TEST_SENTINEL()
+};
+
+int main(void)
+{
+    nlTestSuite theSuite = {
+        "nlflash_spi",
+        &sTests[0],
+    };
+
+    nlTestRunner(&theSuite, NULL);
+
+    return nlTestRunnerStats(&theSuite);
+}
+
+#endif // BUILD_FEATURE_UNIT_TEST